@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "cage.h"
+
+#ifdef HEAP_CAGE
+
+#define CAGE_ALIGNMENT 8
+
+char *cage_base = NULL;
+static size_t cage_top;
+
+void init_cage() {
+    void *base = mmap(NULL, CAGE_RESERVED, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Could not reserve the heap cage.\n");
+        exit(1);
+    }
+    cage_base = (char *)base;
+    // keeps offset 0 free for NULL
+    cage_top = CAGE_ALIGNMENT;
+}
+
+void free_cage() {
+    munmap(cage_base, CAGE_RESERVED);
+    cage_base = NULL;
+}
+
+void *cage_allocate(size_t size) {
+    size = (size + CAGE_ALIGNMENT - 1) & ~(size_t)(CAGE_ALIGNMENT - 1);
+    if UNLIKELY(size > CAGE_RESERVED - cage_top) {
+        fprintf(stderr, "Heap cage exhausted.\n");
+        exit(1);
+    }
+    void *result = cage_base + cage_top;
+    cage_top += size;
+    return result;
+}
+
+size_t cage_map(int fd, size_t size, size_t offset) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (offset < cage_top) {
+        offset = (cage_top + page - 1) & ~(page - 1);
+    }
+    if (size > CAGE_RESERVED - offset) {
+        return 0;
+    }
+    // replaces the reserved pages there
+    void *address = mmap(cage_base + offset, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (address == MAP_FAILED) {
+        return 0;
+    }
+    cage_top = (offset + size + CAGE_ALIGNMENT - 1)
+        & ~(size_t)(CAGE_ALIGNMENT - 1);
+    return offset;
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef CAGE_H
+#define CAGE_H
+
+#include <stddef.h>
+#include "common.h"
+
+// With HEAP_CAGE every object is carved out of one reserved mapping and
+// objects refer to each other by 32-bit offsets from its base (ObjectRef
+// in object.h). Offset 0 is never handed out, so it doubles as NULL.
+// Objects live until free_vm(), so the cage only ever bumps a pointer and
+// is released as a whole; pages are committed by the kernel as they are
+// first touched.
+
+#ifdef HEAP_CAGE
+
+#define CAGE_RESERVED ((size_t)1 << 32)
+
+extern char *cage_base;
+
+void init_cage();
+void free_cage();
+// `size` bytes aligned for any object, exits if the cage is full
+void *cage_allocate(size_t size);
+// Maps `size` bytes of the file `fd` into the cage at `offset` if nothing
+// has been allocated there yet, at the next free page otherwise. Returns
+// the offset it went to, 0 on failure.
+size_t cage_map(int fd, size_t size, size_t offset);
+
+#endif
+
+#endif
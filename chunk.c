@@ -1,7 +1,9 @@
 #include <endian.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
@@ -9,9 +11,21 @@
 inline void init_chunk(Chunk *chunk, bool with_capacity) {
     chunk->count = 0;
     chunk->capacity = with_capacity ? 8 : 0;
-    chunk->code = with_capacity ? ALLOCATE(uint8_t, 8) : NULL;
-    chunk->lines = with_capacity ? ALLOCATE(int, 8) : NULL;
+    chunk->code = with_capacity ? ALLOCATE(uint8_t, 8, MEM_CODE) : NULL;
+    chunk->lines = with_capacity ? ALLOCATE(int, 8, MEM_LINES) : NULL;
     init_value_array(&chunk->constants, with_capacity);
+    chunk->frozen = NULL;
+    chunk->loop_count = 0;
+    chunk->loop_capacity = 0;
+    chunk->loops = NULL;
+    chunk->property_count = 0;
+    chunk->property_capacity = 0;
+    chunk->properties = NULL;
+    chunk->caches = NULL;
+    chunk->coverage = NULL;
+#ifdef DISPATCH_THREADED
+    chunk->threaded = NULL;
+#endif
 }
 
 void write_chunk(Chunk *chunk, uint8_t byte, int line) {
@@ -19,8 +33,12 @@ void write_chunk(Chunk *chunk, uint8_t byte, int line) {
         int old_capacity = chunk->capacity;
         chunk->capacity = 2 * old_capacity;
         chunk->code =
-            GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+            GROW_ARRAY(
+                uint8_t, chunk->code, old_capacity, chunk->capacity, MEM_CODE
+            );
+        chunk->lines = GROW_ARRAY(
+            int, chunk->lines, old_capacity, chunk->capacity, MEM_LINES
+        );
     }
 
     chunk->code[chunk->count] = byte;
@@ -28,10 +46,108 @@ void write_chunk(Chunk *chunk, uint8_t byte, int line) {
     chunk->count++;
 }
 
-void free_chunk(Chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+#define CACHE_LINE 64
+
+// Where the parts of a frozen chunk go: code at 0, then the constants,
+// then the lines, and the size of the whole.
+typedef struct {
+    size_t alignment;
+    size_t constants;
+    size_t lines;
+    size_t size;
+} FrozenLayout;
+
+static inline size_t align_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static FrozenLayout frozen_layout(Chunk *chunk) {
+    FrozenLayout layout;
+#ifdef PROTECT_CHUNKS
+    // mprotect() goes by pages and the code has to stay writable
+    layout.alignment = (size_t)sysconf(_SC_PAGESIZE);
+    layout.constants = align_up(chunk->count, layout.alignment);
+#else
+    layout.alignment = CACHE_LINE;
+    layout.constants = align_up(chunk->count, sizeof(Value));
+#endif
+    layout.lines = layout.constants + sizeof(Value) * chunk->constants.count;
+    layout.size = align_up(
+        layout.lines + sizeof(int) * chunk->count, layout.alignment
+    );
+    return layout;
+}
+
+void freeze_chunk(Chunk *chunk) {
+    FrozenLayout layout = frozen_layout(chunk);
+    char *block = (char *)aligned_alloc(layout.alignment, layout.size);
+    if (block == NULL) exit(1);
+    // the padding counts with the code
+    track_memory(MEM_CODE, 0, layout.constants);
+    track_memory(MEM_CONSTANTS, 0, layout.lines - layout.constants);
+    track_memory(MEM_LINES, 0, layout.size - layout.lines);
+
+    memcpy(block, chunk->code, chunk->count);
+    memcpy(block + layout.constants, chunk->constants.values,
+        sizeof(Value) * chunk->constants.count);
+    memcpy(block + layout.lines, chunk->lines, sizeof(int) * chunk->count);
+    memset(block + layout.lines + sizeof(int) * chunk->count, 0,
+        layout.size - layout.lines - sizeof(int) * chunk->count);
+    int constant_count = chunk->constants.count;
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, MEM_CODE);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity, MEM_LINES);
     free_value_array(&chunk->constants);
+
+    chunk->frozen = block;
+    chunk->capacity = chunk->count;
+    chunk->code = (uint8_t *)block;
+    chunk->lines = (int *)(block + layout.lines);
+    chunk->constants.count = constant_count;
+    chunk->constants.capacity = constant_count;
+    chunk->constants.values = (Value *)(block + layout.constants);
+#ifdef PROTECT_CHUNKS
+    mprotect(block + layout.constants, layout.size - layout.constants,
+        PROT_READ);
+#endif
+}
+
+static void free_frozen(Chunk *chunk) {
+    FrozenLayout layout = frozen_layout(chunk);
+#ifdef PROTECT_CHUNKS
+    // free() may write to it
+    mprotect((char *)chunk->frozen + layout.constants,
+        layout.size - layout.constants, PROT_READ | PROT_WRITE);
+#endif
+    free(chunk->frozen);
+    track_memory(MEM_CODE, layout.constants, 0);
+    track_memory(MEM_CONSTANTS, layout.lines - layout.constants, 0);
+    track_memory(MEM_LINES, layout.size - layout.lines, 0);
+}
+
+void free_chunk(Chunk *chunk) {
+    if (chunk->frozen != NULL) {
+        free_frozen(chunk);
+    } else {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, MEM_CODE);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity, MEM_LINES);
+        free_value_array(&chunk->constants);
+    }
+    FREE_ARRAY(LoopSite, chunk->loops, chunk->loop_capacity, MEM_LOOPS);
+    if (chunk->properties != NULL) {
+        FREE_ARRAY(PropertyCache, chunk->properties, chunk->property_capacity,
+            MEM_CODE);
+    }
+    if (chunk->caches != NULL) {
+        FREE_ARRAY(InlineCache, chunk->caches, chunk->count, MEM_CODE);
+    }
+    if (chunk->coverage != NULL) {
+        FREE_ARRAY(uint8_t, chunk->coverage, chunk->count, MEM_CODE);
+    }
+#ifdef DISPATCH_THREADED
+    if (chunk->threaded != NULL) {
+        FREE_ARRAY(ThreadedWord, chunk->threaded, chunk->count, MEM_CODE);
+    }
+#endif
     init_chunk(chunk, false);
 }
 
@@ -39,3 +155,62 @@ int add_constant(Chunk *chunk, Value value) {
     write_value_array(&chunk->constants, value);
     return chunk->constants.count - 1;
 }
+
+int add_loop_site(Chunk *chunk, int offset) {
+    if (chunk->loop_capacity < chunk->loop_count + 1) {
+        int old_capacity = chunk->loop_capacity;
+        chunk->loop_capacity = old_capacity < 8 ? 8 : 2 * old_capacity;
+        chunk->loops = GROW_ARRAY(
+            LoopSite, chunk->loops, old_capacity, chunk->loop_capacity,
+            MEM_LOOPS
+        );
+    }
+    chunk->loops[chunk->loop_count] = (LoopSite){.offset = offset, .hits = 0};
+    return chunk->loop_count++;
+}
+
+int add_property_site(Chunk *chunk) {
+    if (chunk->property_capacity < chunk->property_count + 1) {
+        int old_capacity = chunk->property_capacity;
+        chunk->property_capacity = old_capacity < 8 ? 8 : 2 * old_capacity;
+        chunk->properties = GROW_ARRAY(
+            PropertyCache, chunk->properties, old_capacity,
+            chunk->property_capacity, MEM_CODE
+        );
+    }
+    memset(&chunk->properties[chunk->property_count], 0,
+        sizeof(PropertyCache));
+    return chunk->property_count++;
+}
+
+bool can_specialize(Chunk *chunk, int offset) {
+    return chunk->caches == NULL || chunk->caches[offset].deopts < DEOPT_LIMIT;
+}
+
+InlineCache *inline_cache(Chunk *chunk, int offset) {
+    if UNLIKELY(chunk->caches == NULL) {
+        chunk->caches = ALLOCATE(InlineCache, chunk->count, MEM_CODE);
+        memset(chunk->caches, 0, sizeof(InlineCache) * chunk->count);
+    }
+    return &chunk->caches[offset];
+}
+
+// sizes of the operand layouts named in OPCODES, opcode byte included
+enum {
+    LENGTH_simple = 1,
+    LENGTH_constant = 2,
+    LENGTH_byte = 2,
+    LENGTH_jump = 3,
+    LENGTH_loop = 5,
+    LENGTH_property = 4,
+    LENGTH_invoke = 5
+};
+
+int instruction_length(uint8_t opcode) {
+    static const uint8_t lengths[OPCODE_COUNT] = {
+#define LENGTH(name, operands) [OP_##name] = LENGTH_##operands,
+        OPCODES(LENGTH)
+#undef LENGTH
+    };
+    return lengths[opcode];
+}
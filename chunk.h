@@ -4,39 +4,164 @@
 #include "common.h"
 #include "value.h"
 
+// Every opcode with the layout of its operands. The order fixes the opcode
+// numbers; the layouts name the helpers that decode them in debug.c and in
+// the threading pass in vm.c.
+#define OPCODES(X) \
+    X(CONSTANT, constant) \
+    X(NEGATE, simple) \
+    X(PRINT, simple) \
+    X(POP, simple) \
+    X(NIL, simple) \
+    X(TRUE, simple) \
+    X(FALSE, simple) \
+    X(ADD, simple) \
+    X(SUBTRACT, simple) \
+    X(MULTIPLY, simple) \
+    X(DIVIDE, simple) \
+    X(NOT, simple) \
+    X(EQUAL, simple) \
+    X(GREATER, simple) \
+    X(LESS, simple) \
+    X(RETURN, simple) \
+    X(DEFINE_GLOBAL, constant) \
+    X(GET_GLOBAL, constant) \
+    X(SET_GLOBAL, constant) \
+    X(GET_LOCAL, byte) \
+    X(SET_LOCAL, byte) \
+    X(JUMP, jump) \
+    X(JUMP_IF_FALSE, jump) \
+    X(JUMP_IF_TRUE, jump) \
+    X(JUMP_IF_FALSE_OR_POP, jump) \
+    X(JUMP_IF_TRUE_OR_POP, jump) \
+    X(LOOP, loop) \
+    X(CALL, byte) \
+    X(TAIL_CALL, byte) \
+    X(ADD_NUMBER, simple) \
+    X(ADD_STRING, simple) \
+    X(GET_GLOBAL_CACHED, constant) \
+    X(ADD_NN, simple) \
+    X(SUBTRACT_NN, simple) \
+    X(MULTIPLY_NN, simple) \
+    X(DIVIDE_NN, simple) \
+    X(GREATER_NN, simple) \
+    X(LESS_NN, simple) \
+    X(BUILD_LIST, byte) \
+    X(GET_INDEX, simple) \
+    X(SET_INDEX, simple) \
+    X(BUILD_MAP, byte) \
+    X(DELETE, simple) \
+    X(CONTAINS, simple) \
+    X(CLASS, constant) \
+    X(INHERIT, simple) \
+    X(METHOD, constant) \
+    X(GET_PROPERTY, property) \
+    X(SET_PROPERTY, property) \
+    X(INVOKE, invoke) \
+    X(GET_SUPER, property) \
+    X(SUPER_INVOKE, invoke)
+
 typedef enum {
-    OP_CONSTANT,
-    OP_NEGATE,
-    OP_PRINT,
-    OP_POP,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_ADD,
-    OP_SUBTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_NOT,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    OP_RETURN,
-    OP_DEFINE_GLOBAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL
+#define OPCODE_ENUM(name, operands) OP_##name,
+    OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+    OPCODE_COUNT
 } OpCode;
 
+// Property instructions carry a cache of what they found on the instance
+// shapes they have seen (see Shape in object.h): `OP_GET_PROPERTY name
+// site` has the name's constant and the index of its PropertyCache in
+// the chunk. Up to PROPERTY_CACHE_WAYS shapes are cached per site, a site
+// that sees more is megamorphic and looks the others up every time.
+#define PROPERTY_CACHE_WAYS 4
+
+typedef struct {
+    // NULL in an unused way
+    struct Shape *shape;
+    // the field's slot in instances of `shape`, -1 for a method
+    int slot;
+    // the method when `slot` is -1; SET_PROPERTY keeps the shape after
+    // the store here, which is `shape` unless the store adds the field
+    Object *target;
+} PropertyWay;
+
+typedef struct {
+    PropertyWay ways[PROPERTY_CACHE_WAYS];
+} PropertyCache;
+
+#ifdef DISPATCH_THREADED
+// Threaded code has one word for every byte of `code`: the opcode byte
+// becomes the address of its handler and the first operand byte holds the
+// decoded operand, so offsets and jumps carry over unchanged.
+typedef union {
+    void *handler;
+    Value *constant;
+    PropertyCache *cache;
+    int operand;
+} ThreadedWord;
+#endif
+
+// One per loop back-edge, `OP_LOOP offset site` bumps `hits` every time
+// the loop goes around.
+typedef struct {
+    // first instruction of the loop
+    int offset;
+    uint64_t hits;
+} LoopSite;
+
+// Generic instructions rewrite themselves into specialized ones for the
+// operands they see (quickening). A specialized instruction whose guard
+// fails turns back into the generic one; after DEOPT_LIMIT such failures
+// the site stays generic.
+#define DEOPT_LIMIT 4
+
+// Per-instruction state for quickening, indexed by the offset of the
+// opcode and allocated when an instruction of the chunk first specializes.
+typedef struct {
+    uint8_t deopts;
+    // GET_GLOBAL_CACHED: where the global was last found in vm.globals
+    int slot;
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    // the block code, constants and lines moved to, see freeze_chunk()
+    void *frozen;
+    int loop_count;
+    int loop_capacity;
+    LoopSite *loops;
+    int property_count;
+    int property_capacity;
+    PropertyCache *properties;
+    InlineCache *caches;
+    // nonzero for every instruction that ran under INSTRUMENT_COVERAGE,
+    // allocated when the first one does
+    uint8_t *coverage;
+#ifdef DISPATCH_THREADED
+    // built on first call, see run()
+    ThreadedWord *threaded;
+#endif
 } Chunk;
 
 void init_chunk(Chunk *chunk, bool with_capacity);
 void write_chunk(Chunk *chunk, uint8_t byte, int line);
 void free_chunk(Chunk *chunk);
+// Moves code, constants and lines into one block of exactly their size,
+// aligned to a cache line, constants right after the code. Nothing may be
+// written or added to the chunk after this but through quickening, which
+// rewrites opcodes in place. With PROTECT_CHUNKS the constants and lines
+// start on a page of their own and are made read-only.
+void freeze_chunk(Chunk *chunk);
 int add_constant(Chunk *chunk, Value value);
+int add_loop_site(Chunk *chunk, int offset);
+int add_property_site(Chunk *chunk);
+bool can_specialize(Chunk *chunk, int offset);
+InlineCache *inline_cache(Chunk *chunk, int offset);
+// bytes taken by the instruction, operands included
+int instruction_length(uint8_t opcode);
 
 #endif
@@ -0,0 +1,118 @@
+#include "class.h"
+#include "memory.h"
+#include "table.h"
+
+void class_inherit(Class *klass, Class *superclass) {
+    klass->superclass = superclass;
+    klass->initializer = superclass->initializer;
+}
+
+void class_add_method(Class *klass, String *name, Function *method) {
+    table_set(&klass->methods, name, OBJECT_VAL(method));
+    if (name->length == 4 && memcmp(string_chars(name), "init", 4) == 0) {
+        klass->initializer = method;
+    }
+}
+
+Function *find_method(Class *klass, String *name) {
+    for (; klass != NULL; klass = klass->superclass) {
+        Value method;
+        if (table_get(&klass->methods, name, &method)) {
+            return AS_FUNCTION(method);
+        }
+    }
+    return NULL;
+}
+
+// `super` refers to the superclass of the class whose declaration has the
+// running method. With no closures to carry that class along, it is found
+// again from the receiver's: the first class up the chain that has the
+// method as its own.
+Function *find_super_method(Class *klass, Function *running, String *name) {
+    for (; klass != NULL; klass = klass->superclass) {
+        Value method;
+        if (table_get(&klass->methods, running->name, &method)
+            && AS_FUNCTION(method) == running) {
+            return klass->superclass == NULL
+                ? NULL : find_method(klass->superclass, name);
+        }
+    }
+    return NULL;
+}
+
+Shape *shape_transition(Shape *shape, String *name) {
+    Value next;
+    if (table_get(&shape->transitions, name, &next)) {
+        return (Shape *)AS_OBJECT(next);
+    }
+    Shape *added = new_shape(shape->klass, shape, name);
+    table_set(&shape->transitions, name, OBJECT_VAL(added));
+    return added;
+}
+
+// Walks the fields from the last one added. Field names are interned, so
+// they compare by reference.
+int shape_slot(Shape *shape, String *name) {
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name) {
+            return shape->count - 1;
+        }
+    }
+    return -1;
+}
+
+void instance_store(Instance *instance, Shape *shape, int slot, Value value) {
+    if UNLIKELY(slot >= instance->capacity) {
+        int old_capacity = instance->capacity;
+        instance->capacity = old_capacity < 4 ? 4 : 2 * old_capacity;
+        instance->fields = GROW_ARRAY(
+            Value, instance->fields, old_capacity, instance->capacity,
+            MEM_INSTANCE
+        );
+    }
+    instance->shape = shape;
+    instance->fields[slot] = value;
+    Class *klass = shape->klass;
+    if (shape->count > klass->slot_hint) {
+        klass->slot_hint = shape->count;
+    }
+}
+
+PropertyWay lookup_property(PropertyCache *cache, Shape *shape, String *name) {
+    PropertyWay *cached = cached_way(cache, shape);
+    if (cached != NULL) {
+        return *cached;
+    }
+    PropertyWay way = {.shape = shape, .slot = shape_slot(shape, name)};
+    way.target = way.slot >= 0
+        ? NULL : (Object *)find_method(shape->klass, name);
+    if (way.slot >= 0 || way.target != NULL) {
+        cache_property(cache, way);
+    }
+    return way;
+}
+
+PropertyWay lookup_store(PropertyCache *cache, Shape *shape, String *name) {
+    PropertyWay *cached = cached_way(cache, shape);
+    if (cached != NULL) {
+        return *cached;
+    }
+    PropertyWay way = {.shape = shape, .slot = shape_slot(shape, name)};
+    if (way.slot >= 0) {
+        way.target = (Object *)shape;
+    } else {
+        way.target = (Object *)shape_transition(shape, name);
+        way.slot = shape->count;
+    }
+    cache_property(cache, way);
+    return way;
+}
+
+void cache_property(PropertyCache *cache, PropertyWay way) {
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+        if (cache->ways[i].shape == NULL) {
+            cache->ways[i] = way;
+            return;
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef CLASS_H
+#define CLASS_H
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Operations on classes, instances and their shapes, see Shape in
+// object.h, and the property caches that key on the shapes, see chunk.h.
+
+void class_inherit(Class *klass, Class *superclass);
+void class_add_method(Class *klass, String *name, Function *method);
+// `name` in `klass` or its superclasses, NULL if none has it
+Function *find_method(Class *klass, String *name);
+// The method `super.name` means in `running`, a method of `klass` or of
+// one of its superclasses. NULL if the superclass has no such method.
+Function *find_super_method(Class *klass, Function *running, String *name);
+
+// the shape `shape` moves to when `name` is added, made the first time
+Shape *shape_transition(Shape *shape, String *name);
+// where instances of `shape` keep field `name`, -1 if they have none
+int shape_slot(Shape *shape, String *name);
+// Stores `value` in field `slot` and moves the instance to `shape`, which
+// has `slot` as one of its fields. Grows the fields as needed.
+void instance_store(Instance *instance, Shape *shape, int slot, Value value);
+
+// What `name` is on instances of `shape`, for reading it: a field
+// (`slot`), a method (`target`) or neither (-1 and NULL). Filled in from
+// and into the cache.
+PropertyWay lookup_property(PropertyCache *cache, Shape *shape, String *name);
+// The same for storing to it: the field's slot and the shape after the
+// store, which adds the field if it is missing.
+PropertyWay lookup_store(PropertyCache *cache, Shape *shape, String *name);
+// Adds a way for `shape` unless the site is megamorphic.
+void cache_property(PropertyCache *cache, PropertyWay way);
+
+// the way for `shape`, NULL on a miss; a monomorphic site hits the first
+static inline PropertyWay *cached_way(PropertyCache *cache, Shape *shape) {
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+        if (cache->ways[i].shape == shape) {
+            return &cache->ways[i];
+        }
+    }
+    return NULL;
+}
+
+#endif
@@ -7,7 +7,16 @@
 #include <assert.h>
 
 #define UNREACHABLE() __builtin_unreachable()
+#define LIKELY(condition) (__builtin_expect((condition), 1))
 #define UNLIKELY(condition) (__builtin_expect((condition), 0))
 #define UNUSED __attribute__((unused))
 
+#define UINT8_COUNT (UINT8_MAX + 1)
+
+// dispatch engine for run(), normally picked by CMake
+#if !defined(DISPATCH_SWITCH) && !defined(DISPATCH_GOTO) \
+    && !defined(DISPATCH_THREADED) && !defined(DISPATCH_TAILCALL)
+#define DISPATCH_GOTO
+#endif
+
 #endif
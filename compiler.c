@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "number.h"
 #include "scanner.h"
 #include "value.h"
 #include "object.h"
@@ -10,13 +12,69 @@
 #include "debug.h"
 #endif
 
+// Jumps out of an `if`, `while` or `for` condition. `and` and `or` at the
+// top level of a condition branch straight to the body or past it instead
+// of leaving their operand on the stack for a final test.
+typedef struct {
+    int false_jumps[UINT8_COUNT];
+    int false_count;
+    int true_jumps[UINT8_COUNT];
+    int true_count;
+} Condition;
+
+// What the compiler can tell about the value of an expression. Only
+// operands known to be numbers on both sides get the unchecked opcodes.
+typedef enum {
+    STATIC_UNKNOWN,
+    STATIC_NIL,
+    STATIC_BOOL,
+    STATIC_NUMBER,
+    STATIC_STRING
+} StaticType;
+
 typedef struct {
     Token previous;
     Token current;
     bool had_error;
     bool panic_mode;
+    // set while the top level of a condition is being parsed
+    Condition *condition;
+    // of the expression compiled last, every parse rule sets it
+    StaticType type;
 } Parser;
 
+typedef struct {
+    Token name;
+    // -1 while the initializer is being compiled
+    int depth;
+} Local;
+
+typedef enum {
+    TYPE_FUNCTION,
+    TYPE_INITIALIZER,
+    TYPE_METHOD,
+    TYPE_SCRIPT
+} FunctionType;
+
+typedef struct Compiler {
+    struct Compiler *enclosing;
+    Function *function;
+    FunctionType type;
+    Local locals[UINT8_COUNT];
+    int local_count;
+    int scope_depth;
+    // offset of the most recent OP_CALL, for spotting calls in tail position
+    int last_call;
+    // offset of the most recent OP_GET_INDEX, which `delete` takes over
+    int last_index;
+} Compiler;
+
+// the class declarations being compiled, innermost first
+typedef struct ClassCompiler {
+    struct ClassCompiler *enclosing;
+    bool has_superclass;
+} ClassCompiler;
+
 typedef enum {
     PREC_NONE,
     PREC_ASSIGNMENT,
@@ -46,20 +104,34 @@ static void number(UNUSED bool assignable);
 static void literal(UNUSED bool assignable);
 static void variable(bool assignable);
 static void string(UNUSED bool assignable);
+static void and_(UNUSED bool assignable);
+static void or_(UNUSED bool assignable);
+static void call(UNUSED bool assignable);
+static void list(UNUSED bool assignable);
+static void subscript(bool assignable);
+static void map(UNUSED bool assignable);
+static void in_(UNUSED bool assignable);
+static void delete_(UNUSED bool assignable);
+static void dot(bool assignable);
+static void this_(UNUSED bool assignable);
+static void super_(UNUSED bool assignable);
 static uint8_t make_constant(Value value);
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_BANG] = {unary, NULL, PREC_NONE},
     [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
@@ -71,19 +143,21 @@ ParseRule rules[] = {
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DELETE] = {delete_, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IN] = {NULL, in_, PREC_COMPARISON},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -93,10 +167,11 @@ ParseRule rules[] = {
 
 
 Parser parser;
-Chunk *compiling_chunk;
+Compiler *current = NULL;
+ClassCompiler *current_class = NULL;
 
 static Chunk *current_chunk() {
-    return compiling_chunk;
+    return &current->function->chunk;
 }
 
 
@@ -129,7 +204,7 @@ static void advance() {
     parser.previous = parser.current;
 
     for (;;) {
-        parser.current = scan_token();
+        parser.current = next_token();
 
         if (parser.current.type != TOKEN_ERROR)
             break;
@@ -163,12 +238,126 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2) {
     emit_byte(byte2);
 }
 
-static void end_compiler() {
+static int emit_jump(uint8_t instruction) {
+    emit_byte(instruction);
+    emit_bytes(0xff, 0xff);
+    return current_chunk()->count - 2;
+}
+
+static void patch_jump(int offset) {
+    // -2 to skip over the jump offset itself
+    int jump = current_chunk()->count - offset - 2;
+    if (jump > UINT16_MAX) {
+        error("Too much code to jump over.");
+    }
+    current_chunk()->code[offset] = (jump >> 8) & 0xff;
+    current_chunk()->code[offset + 1] = jump & 0xff;
+}
+
+static void emit_loop(int loop_start) {
+    Chunk *chunk = current_chunk();
+    int site = add_loop_site(chunk, loop_start);
+    emit_byte(OP_LOOP);
+    // +4 for the offset and site operands
+    int offset = chunk->count - loop_start + 4;
+    if (offset > UINT16_MAX) {
+        error("Loop body too large.");
+    }
+    if (site > UINT16_MAX) {
+        error("Too many loops in one chunk.");
+    }
+    emit_bytes((offset >> 8) & 0xff, offset & 0xff);
+    emit_bytes((site >> 8) & 0xff, site & 0xff);
+}
+
+static void add_jump(int *jumps, int *count, int offset) {
+    if (*count == UINT8_COUNT) {
+        error("Too many 'and' and 'or' operands in one condition.");
+        return;
+    }
+    jumps[(*count)++] = offset;
+}
+
+static void patch_jumps(int *jumps, int *count) {
+    for (int i = 0; i < *count; i++) {
+        patch_jump(jumps[i]);
+    }
+    *count = 0;
+}
+
+typedef struct {
+    Scanner scanner;
+    Token previous;
+    Token current;
+} ParserPosition;
+
+static ParserPosition save_position() {
+    return (ParserPosition){
+        .scanner = save_scanner(),
+        .previous = parser.previous,
+        .current = parser.current
+    };
+}
+
+static void restore_position(ParserPosition position) {
+    restore_scanner(position.scanner);
+    parser.previous = position.previous;
+    parser.current = position.current;
+}
+
+static void init_compiler(Compiler *compiler, FunctionType type) {
+    compiler->enclosing = current;
+    compiler->function = NULL;
+    compiler->type = type;
+    compiler->local_count = 0;
+    compiler->scope_depth = 0;
+    compiler->last_call = -1;
+    compiler->last_index = -1;
+    compiler->function = new_function();
+    current = compiler;
+    if (type != TYPE_SCRIPT) {
+        current->function->name =
+            borrow_string(parser.previous.start, parser.previous.length);
+    }
+
+    // slot zero holds the function being called, or the receiver in a
+    // method
+    Local *local = &current->locals[current->local_count++];
+    local->depth = 0;
+    if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+        local->name.start = "this";
+        local->name.length = 4;
+    } else {
+        local->name.start = "";
+        local->name.length = 0;
+    }
+}
+
+static void emit_return() {
+    if (current->type == TYPE_INITIALIZER) {
+        // an initializer returns the new instance
+        emit_bytes(OP_GET_LOCAL, 0);
+    } else {
+        emit_byte(OP_NIL);
+    }
+    emit_byte(OP_RETURN);
+}
+
+static Function *end_compiler() {
+    emit_return();
+    Function *function = current->function;
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error)
-        disassemble_chunk(current_chunk(), "code");
+    if (!parser.had_error) {
+        disassemble_chunk(
+            current_chunk(),
+            function->name != NULL
+                ? string_cstring(function->name) : "<script>"
+        );
+    }
 #endif
-    emit_byte(OP_RETURN);
+    freeze_chunk(current_chunk());
+    current = current->enclosing;
+    return function;
 }
 
 static void parse_precedence(Precedence precedence) {
@@ -194,18 +383,307 @@ static void parse_precedence(Precedence precedence) {
 }
 
 static void expression() {
+    // nested expressions produce values, even inside a condition
+    Condition *condition = parser.condition;
+    parser.condition = NULL;
+    parse_precedence(PREC_ASSIGNMENT);
+    parser.condition = condition;
+}
+
+// Compiles a condition that falls through into the code that follows
+// when it holds. The caller patches `condition->false_jumps` to wherever
+// execution should continue otherwise. Nothing is left on the stack.
+static void condition(Condition *condition) {
+    Condition *enclosing = parser.condition;
+    condition->false_count = 0;
+    condition->true_count = 0;
+    parser.condition = condition;
     parse_precedence(PREC_ASSIGNMENT);
+    parser.condition = enclosing;
+
+    add_jump(condition->false_jumps, &condition->false_count,
+        emit_jump(OP_JUMP_IF_FALSE));
+    patch_jumps(condition->true_jumps, &condition->true_count);
+}
+
+static void statement();
+static void declaration();
+
+static void begin_scope() {
+    current->scope_depth++;
+}
+
+static void end_scope() {
+    current->scope_depth--;
+    while (current->local_count > 0
+           && current->locals[current->local_count - 1].depth
+               > current->scope_depth) {
+        emit_byte(OP_POP);
+        current->local_count--;
+    }
+}
+
+static bool identifiers_equal(Token *a, Token *b) {
+    return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
+
+static int resolve_local(Compiler *compiler, Token *name) {
+    for (int i = compiler->local_count - 1; i >= 0; i--) {
+        Local *local = &compiler->locals[i];
+        if (identifiers_equal(name, &local->name)) {
+            if (local->depth == -1) {
+                error("Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void add_local(Token name) {
+    if (current->local_count == UINT8_COUNT) {
+        error("Too many local variables in function.");
+        return;
+    }
+    Local *local = &current->locals[current->local_count++];
+    local->name = name;
+    local->depth = -1;
+}
+
+static void declare_local(Token *name) {
+    for (int i = current->local_count - 1; i >= 0; i--) {
+        Local *local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scope_depth) {
+            break;
+        }
+        if (identifiers_equal(name, &local->name)) {
+            error("Already a variable with this name in this scope.");
+        }
+    }
+    add_local(*name);
+}
+
+static uint8_t identifier_constant(Token *name) {
+    return make_constant(
+        OBJECT_VAL(borrow_string(name->start, name->length))
+    );
 }
 
 static void variable(bool assignable) {
     Token name = parser.previous;
-    Value symbol = OBJECT_VAL(copy_string(name.start, name.length));
+    uint8_t get_op, set_op;
+    int arg = resolve_local(current, &name);
+    if (arg != -1) {
+        get_op = OP_GET_LOCAL;
+        set_op = OP_SET_LOCAL;
+    } else {
+        arg = identifier_constant(&name);
+        get_op = OP_GET_GLOBAL;
+        set_op = OP_SET_GLOBAL;
+    }
+
     if (assignable && match(TOKEN_EQUAL)) {
+        // an assignment has the type of the assigned value
         expression();
-        emit_bytes(OP_SET_GLOBAL, make_constant(symbol));
+        emit_bytes(set_op, (uint8_t)arg);
     } else {
-        emit_bytes(OP_GET_GLOBAL, make_constant(symbol));
+        emit_bytes(get_op, (uint8_t)arg);
+        parser.type = STATIC_UNKNOWN;
+    }
+}
+
+// Declares the variable named by the next token. Returns the constant
+// holding its name for a global, 0 for a local.
+static uint8_t parse_variable(const char *message) {
+    consume(TOKEN_IDENTIFIER, message);
+    if (current->scope_depth > 0) {
+        declare_local(&parser.previous);
+        return 0;
     }
+    return identifier_constant(&parser.previous);
+}
+
+static void mark_initialized() {
+    if (current->scope_depth == 0) return;
+    current->locals[current->local_count - 1].depth = current->scope_depth;
+}
+
+static void define_variable(uint8_t global) {
+    if (current->scope_depth > 0) {
+        // the value stays on the stack as the local's slot
+        mark_initialized();
+        return;
+    }
+    emit_bytes(OP_DEFINE_GLOBAL, global);
+}
+
+static uint8_t argument_list() {
+    uint8_t arg_count = 0;
+    if (parser.current.type != TOKEN_RIGHT_PAREN) {
+        do {
+            expression();
+            if (arg_count == 255) {
+                error("Can't have more than 255 arguments.");
+            }
+            arg_count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return arg_count;
+}
+
+static void call(UNUSED bool assignable) {
+    uint8_t arg_count = argument_list();
+    emit_bytes(OP_CALL, arg_count);
+    current->last_call = current_chunk()->count - 2;
+    parser.type = STATIC_UNKNOWN;
+}
+
+// `OP_... name site`, see PropertyCache
+static void emit_property(OpCode opcode, uint8_t name) {
+    emit_bytes(opcode, name);
+    int site = add_property_site(current_chunk());
+    if (site > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+    emit_bytes((site >> 8) & 0xff, site & 0xff);
+}
+
+static void dot(bool assignable) {
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifier_constant(&parser.previous);
+    if (assignable && match(TOKEN_EQUAL)) {
+        // an assignment has the type of the assigned value
+        expression();
+        emit_property(OP_SET_PROPERTY, name);
+    } else if (match(TOKEN_LEFT_PAREN)) {
+        uint8_t arg_count = argument_list();
+        emit_property(OP_INVOKE, name);
+        emit_byte(arg_count);
+        parser.type = STATIC_UNKNOWN;
+    } else {
+        emit_property(OP_GET_PROPERTY, name);
+        parser.type = STATIC_UNKNOWN;
+    }
+}
+
+// With no closures, functions nested in a method cannot see its receiver.
+static bool in_method(const char *keyword) {
+    if (current_class == NULL) {
+        char message[64];
+        snprintf(message, sizeof(message),
+            "Can't use '%s' outside of a class.", keyword);
+        error(message);
+        return false;
+    }
+    if (current->type != TYPE_METHOD && current->type != TYPE_INITIALIZER) {
+        char message[64];
+        snprintf(message, sizeof(message),
+            "Can't use '%s' outside of a method.", keyword);
+        error(message);
+        return false;
+    }
+    return true;
+}
+
+static void this_(UNUSED bool assignable) {
+    in_method("this");
+    emit_bytes(OP_GET_LOCAL, 0);
+    parser.type = STATIC_UNKNOWN;
+}
+
+static void super_(UNUSED bool assignable) {
+    if (in_method("super") && !current_class->has_superclass) {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+    consume(TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifier_constant(&parser.previous);
+    emit_bytes(OP_GET_LOCAL, 0);
+    if (match(TOKEN_LEFT_PAREN)) {
+        uint8_t arg_count = argument_list();
+        emit_property(OP_SUPER_INVOKE, name);
+        emit_byte(arg_count);
+    } else {
+        emit_property(OP_GET_SUPER, name);
+    }
+    parser.type = STATIC_UNKNOWN;
+}
+
+static void list(UNUSED bool assignable) {
+    uint8_t count = 0;
+    if (parser.current.type != TOKEN_RIGHT_BRACKET) {
+        do {
+            expression();
+            if (count == 255) {
+                error("Can't have more than 255 elements in a list literal.");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emit_bytes(OP_BUILD_LIST, count);
+    parser.type = STATIC_UNKNOWN;
+}
+
+static void subscript(bool assignable) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+    if (assignable && match(TOKEN_EQUAL)) {
+        // an assignment has the type of the assigned value
+        expression();
+        emit_byte(OP_SET_INDEX);
+    } else {
+        emit_byte(OP_GET_INDEX);
+        current->last_index = current_chunk()->count - 1;
+        parser.type = STATIC_UNKNOWN;
+    }
+}
+
+static void map(UNUSED bool assignable) {
+    uint8_t count = 0;
+    if (parser.current.type != TOKEN_RIGHT_BRACE) {
+        do {
+            expression();
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            expression();
+            if (count == 255) {
+                error("Can't have more than 255 entries in a map literal.");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    emit_bytes(OP_BUILD_MAP, count);
+    parser.type = STATIC_UNKNOWN;
+}
+
+// `key in container`
+static void in_(UNUSED bool assignable) {
+    parse_precedence(PREC_COMPARISON + 1);
+    emit_byte(OP_CONTAINS);
+    parser.type = STATIC_BOOL;
+}
+
+// `delete map[key]` compiles the subscript as usual and turns its
+// OP_GET_INDEX into an OP_DELETE
+static void delete_(UNUSED bool assignable) {
+    parse_precedence(PREC_CALL);
+    Chunk *chunk = current_chunk();
+    if (current->last_index != chunk->count - 1) {
+        error("Can only delete a map entry.");
+        return;
+    }
+    chunk->code[current->last_index] = OP_DELETE;
+    parser.type = STATIC_BOOL;
+}
+
+static void block() {
+    while (parser.current.type != TOKEN_RIGHT_BRACE
+           && parser.current.type != TOKEN_EOF) {
+        declaration();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 static void print_statement() {
@@ -220,9 +698,245 @@ static void expression_statement() {
     emit_byte(OP_POP);
 }
 
+static void var_declaration();
+
+static void function(FunctionType type) {
+    Compiler compiler;
+    init_compiler(&compiler, type);
+    begin_scope();
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (parser.current.type != TOKEN_RIGHT_PAREN) {
+        do {
+            current->function->arity++;
+            if (current->function->arity > 255) {
+                error_at_current("Can't have more than 255 parameters.");
+            }
+            uint8_t constant = parse_variable("Expect parameter name.");
+            define_variable(constant);
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block();
+
+    // no end_scope(), the locals go away with the frame
+    Function *function = end_compiler();
+    emit_bytes(OP_CONSTANT, make_constant(OBJECT_VAL(function)));
+}
+
+static void fun_declaration() {
+    uint8_t global = parse_variable("Expect function name.");
+    // a function may refer to itself in its body
+    mark_initialized();
+    function(TYPE_FUNCTION);
+    define_variable(global);
+}
+
+static void method() {
+    consume(TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t name = identifier_constant(&parser.previous);
+    FunctionType type = TYPE_METHOD;
+    if (parser.previous.length == 4
+        && memcmp(parser.previous.start, "init", 4) == 0) {
+        type = TYPE_INITIALIZER;
+    }
+    function(type);
+    emit_bytes(OP_METHOD, name);
+}
+
+// The class stays on the stack while its superclass and methods are
+// added, then becomes the variable.
+static void class_declaration() {
+    uint8_t global = parse_variable("Expect class name.");
+    Token class_name = parser.previous;
+    mark_initialized();
+    emit_bytes(OP_CLASS, identifier_constant(&class_name));
+
+    ClassCompiler class_compiler = {
+        .enclosing = current_class,
+        .has_superclass = false
+    };
+    current_class = &class_compiler;
+
+    if (match(TOKEN_LESS)) {
+        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+        if (identifiers_equal(&class_name, &parser.previous)) {
+            error("A class can't inherit from itself.");
+        }
+        variable(false);
+        emit_byte(OP_INHERIT);
+        class_compiler.has_superclass = true;
+    }
+
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (parser.current.type != TOKEN_RIGHT_BRACE
+           && parser.current.type != TOKEN_EOF) {
+        method();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    define_variable(global);
+    current_class = current_class->enclosing;
+}
+
+static void return_statement() {
+    if (current->type == TYPE_SCRIPT) {
+        error("Can't return from top-level code.");
+    }
+
+    if (match(TOKEN_SEMICOLON)) {
+        emit_return();
+        return;
+    }
+    if (current->type == TYPE_INITIALIZER) {
+        error("Can't return a value from an initializer.");
+    }
+
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    Chunk *chunk = current_chunk();
+    if (current->last_call == chunk->count - 2) {
+        // nothing is left to do in this frame after the call, so the
+        // callee can take it over
+        chunk->code[current->last_call] = OP_TAIL_CALL;
+    }
+    emit_byte(OP_RETURN);
+}
+
+static void if_statement() {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    Condition then;
+    condition(&then);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    statement();
+
+    if (match(TOKEN_ELSE)) {
+        int else_jump = emit_jump(OP_JUMP);
+        patch_jumps(then.false_jumps, &then.false_count);
+        statement();
+        patch_jump(else_jump);
+    } else {
+        patch_jumps(then.false_jumps, &then.false_count);
+    }
+}
+
+static void while_statement() {
+    int loop_start = current_chunk()->count;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    Condition loop;
+    condition(&loop);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    statement();
+    emit_loop(loop_start);
+    patch_jumps(loop.false_jumps, &loop.false_count);
+}
+
+// whether an expression can end with `type`, so a '{' after it is no map
+static bool ends_operand(TokenType type) {
+    switch (type) {
+        case TOKEN_IDENTIFIER:
+        case TOKEN_STRING:
+        case TOKEN_NUMBER:
+        case TOKEN_FALSE:
+        case TOKEN_NIL:
+        case TOKEN_THIS:
+        case TOKEN_TRUE:
+        case TOKEN_RIGHT_PAREN:
+        case TOKEN_RIGHT_BRACKET:
+        case TOKEN_RIGHT_BRACE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Steps over the increment of a for loop up to its ')'. Nothing is reported
+// here, bad tokens included: that is left to compiling the increment. With
+// the ')' missing it stops where the body would start, at a ';' or at a '{'
+// that cannot begin a map, rather than running on to the end.
+static void skip_increment() {
+    TokenType last = TOKEN_LEFT_PAREN;
+    for (int depth = 0;; parser.current = next_token()) {
+        TokenType type = parser.current.type;
+        if (type == TOKEN_EOF || type == TOKEN_SEMICOLON
+            || (type == TOKEN_LEFT_BRACE && ends_operand(last))) {
+            return;
+        }
+        if (type == TOKEN_LEFT_PAREN) {
+            depth++;
+        } else if (type == TOKEN_RIGHT_PAREN && depth-- == 0) {
+            return;
+        }
+        if (type != TOKEN_ERROR) {
+            last = type;
+        }
+        parser.previous = parser.current;
+    }
+}
+
+static void for_statement() {
+    begin_scope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(TOKEN_SEMICOLON)) {
+        // no initializer
+    } else if (match(TOKEN_VAR)) {
+        var_declaration();
+    } else {
+        expression_statement();
+    }
+
+    int loop_start = current_chunk()->count;
+    Condition loop = {.false_count = 0, .true_count = 0};
+    if (!match(TOKEN_SEMICOLON)) {
+        condition(&loop);
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    }
+
+    // The increment is compiled after the body, so every iteration takes
+    // a single back-edge. Skip over it and come back once the body is done.
+    bool has_increment = parser.current.type != TOKEN_RIGHT_PAREN;
+    ParserPosition increment = save_position();
+    skip_increment();
+    if (has_increment && parser.current.type != TOKEN_RIGHT_PAREN) {
+        // the clauses are broken: compile the increment where it is, so its
+        // own errors come first and in order, and not again after the body
+        restore_position(increment);
+        expression();
+        has_increment = false;
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    statement();
+
+    if (has_increment) {
+        ParserPosition after_body = save_position();
+        restore_position(increment);
+        expression();
+        emit_byte(OP_POP);
+        restore_position(after_body);
+    }
+    emit_loop(loop_start);
+    patch_jumps(loop.false_jumps, &loop.false_count);
+    end_scope();
+}
+
 static void statement() {
     if (match(TOKEN_PRINT)) {
         print_statement();
+    } else if (match(TOKEN_IF)) {
+        if_statement();
+    } else if (match(TOKEN_RETURN)) {
+        return_statement();
+    } else if (match(TOKEN_WHILE)) {
+        while_statement();
+    } else if (match(TOKEN_FOR)) {
+        for_statement();
+    } else if (match(TOKEN_LEFT_BRACE)) {
+        begin_scope();
+        block();
+        end_scope();
     } else {
         expression_statement();
     }
@@ -230,10 +944,7 @@ static void statement() {
 
 static void var_declaration() {
     // identifier should follow after 'var'
-    consume(TOKEN_IDENTIFIER, "Expect a variable name");
-    Token name = parser.previous;
-    Value symbol = OBJECT_VAL(copy_string(name.start, name.length));
-    uint8_t global = make_constant(symbol);
+    uint8_t global = parse_variable("Expect a variable name");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -243,38 +954,46 @@ static void var_declaration() {
 
     const char *message = "Expect ';' after variable declaration";
     consume(TOKEN_SEMICOLON, message);
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    define_variable(global);
+}
+
+static void synchronize() {
+    parser.panic_mode = false;
+    // skip tokens until we find something like
+    // a statement boundary
+    while (parser.current.type != TOKEN_EOF) {
+        if (parser.previous.type == TOKEN_SEMICOLON) {
+            return;
+        }
+        switch (parser.current.type) {
+            case TOKEN_CLASS:
+            case TOKEN_FUN:
+            case TOKEN_VAR:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_PRINT:
+            case TOKEN_RETURN:
+                return;
+            default: /*nothing*/;
+        }
+        advance();
+    }
 }
 
 static void declaration() {
-    if (match(TOKEN_VAR)) {
+    if (match(TOKEN_CLASS)) {
+        class_declaration();
+    } else if (match(TOKEN_FUN)) {
+        fun_declaration();
+    } else if (match(TOKEN_VAR)) {
         var_declaration();
     } else {
         statement();
-    } 
+    }
 
     if (parser.panic_mode) {
-        parser.panic_mode = false;
-        // skip tokens until we find something like 
-        // a token boundary
-        while (parser.current.type != TOKEN_EOF) {
-            if (parser.previous.type == TOKEN_SEMICOLON) {
-                break;
-            }
-            switch (parser.current.type) {
-                case TOKEN_CLASS:
-                case TOKEN_FUN:
-                case TOKEN_VAR:
-                case TOKEN_FOR:
-                case TOKEN_IF:
-                case TOKEN_WHILE:
-                case TOKEN_PRINT:
-                case TOKEN_RETURN:
-                    break;
-                default: /*nothing*/; 
-            }
-            advance();
-        }
+        synchronize();
     }
 }
 
@@ -289,8 +1008,13 @@ static uint8_t make_constant(Value value) {
 }
 
 static void string(UNUSED bool assignable) {
-    String *s = copy_string(parser.previous.start + 1, parser.previous.length - 2);
-    emit_bytes(OP_CONSTANT, make_constant(OBJECT_VAL(s)));
+    const char *data = parser.previous.start + 1;
+    int length = parser.previous.length - 2;
+    // heap strings point into the source
+    Value s = length <= SMALL_STRING_MAX
+        ? small_string(data, length) : OBJECT_VAL(borrow_string(data, length));
+    emit_bytes(OP_CONSTANT, make_constant(s));
+    parser.type = STATIC_STRING;
 }
 
 static void grouping(UNUSED bool assignable) {
@@ -300,8 +1024,50 @@ static void grouping(UNUSED bool assignable) {
 
 
 static void number(UNUSED bool assignable) {
-    double value = strtod(parser.previous.start, NULL);
-    emit_bytes(OP_CONSTANT, make_constant(NUMBER_VAL(value)));
+    double value = parse_number(parser.previous.start, parser.previous.length);
+    emit_bytes(OP_CONSTANT, make_constant(number_value(value)));
+    parser.type = STATIC_NUMBER;
+}
+
+// `and` and `or` produce one of their operands
+static void merge_types(StaticType left) {
+    if (parser.type != left) {
+        parser.type = STATIC_UNKNOWN;
+    }
+}
+
+static void and_(UNUSED bool assignable) {
+    StaticType left = parser.type;
+    Condition *condition = parser.condition;
+    if (condition != NULL) {
+        add_jump(condition->false_jumps, &condition->false_count,
+            emit_jump(OP_JUMP_IF_FALSE));
+        parse_precedence(PREC_AND);
+        parser.type = STATIC_UNKNOWN;
+        return;
+    }
+    int end_jump = emit_jump(OP_JUMP_IF_FALSE_OR_POP);
+    parse_precedence(PREC_AND);
+    patch_jump(end_jump);
+    merge_types(left);
+}
+
+static void or_(UNUSED bool assignable) {
+    StaticType left = parser.type;
+    Condition *condition = parser.condition;
+    if (condition != NULL) {
+        add_jump(condition->true_jumps, &condition->true_count,
+            emit_jump(OP_JUMP_IF_TRUE));
+        // a failed `and` chain on the left moves on to the right operand
+        patch_jumps(condition->false_jumps, &condition->false_count);
+        parse_precedence(PREC_OR);
+        parser.type = STATIC_UNKNOWN;
+        return;
+    }
+    int end_jump = emit_jump(OP_JUMP_IF_TRUE_OR_POP);
+    parse_precedence(PREC_OR);
+    patch_jump(end_jump);
+    merge_types(left);
 }
 
 static void unary(UNUSED bool assignable) {
@@ -312,10 +1078,13 @@ static void unary(UNUSED bool assignable) {
     switch (operator_type) {
         case TOKEN_BANG:
             emit_byte(OP_NOT);
+            parser.type = STATIC_BOOL;
             break;
 
         case TOKEN_MINUS:
+            // anything but a number is a runtime error
             emit_byte(OP_NEGATE);
+            parser.type = STATIC_NUMBER;
             break;
 
         default:
@@ -323,72 +1092,104 @@ static void unary(UNUSED bool assignable) {
     }
 }
 
+// Picks the unchecked form of a numeric opcode when both operands are
+// known to be numbers.
+static void emit_numeric(OpCode checked, OpCode unchecked, StaticType left) {
+    bool numbers = left == STATIC_NUMBER && parser.type == STATIC_NUMBER;
+    emit_byte(numbers ? unchecked : checked);
+}
+
 static void binary(UNUSED bool assignable) {
     TokenType operator_type = parser.previous.type;
+    StaticType left = parser.type;
     ParseRule *rule = &rules[operator_type];
     parse_precedence((Precedence)(rule->precedence + 1));
+    StaticType right = parser.type;
 
+    // arithmetic either produces a number or stops with a runtime error
+    StaticType type = STATIC_NUMBER;
     switch (operator_type) {
         case TOKEN_BANG_EQUAL:
             emit_bytes(OP_EQUAL, OP_NOT);
+            type = STATIC_BOOL;
             break;
         case TOKEN_EQUAL_EQUAL:
             emit_byte(OP_EQUAL);
+            type = STATIC_BOOL;
             break;
         case TOKEN_GREATER:
-            emit_byte(OP_GREATER);
+            emit_numeric(OP_GREATER, OP_GREATER_NN, left);
+            type = STATIC_BOOL;
             break;
         case TOKEN_GREATER_EQUAL:
-            emit_bytes(OP_LESS, OP_NOT);
+            emit_numeric(OP_LESS, OP_LESS_NN, left);
+            emit_byte(OP_NOT);
+            type = STATIC_BOOL;
             break;
         case TOKEN_LESS:
-            emit_byte(OP_LESS);
+            emit_numeric(OP_LESS, OP_LESS_NN, left);
+            type = STATIC_BOOL;
             break;
         case TOKEN_LESS_EQUAL:
-            emit_bytes(OP_GREATER, OP_NOT);
+            emit_numeric(OP_GREATER, OP_GREATER_NN, left);
+            emit_byte(OP_NOT);
+            type = STATIC_BOOL;
             break;
         case TOKEN_PLUS:
-            emit_byte(OP_ADD);
+            emit_numeric(OP_ADD, OP_ADD_NN, left);
+            // only number + number and string + string get through
+            if (left == STATIC_STRING || right == STATIC_STRING) {
+                type = STATIC_STRING;
+            } else if (left != STATIC_NUMBER && right != STATIC_NUMBER) {
+                type = STATIC_UNKNOWN;
+            }
             break;
         case TOKEN_MINUS:
-            emit_byte(OP_SUBTRACT);
+            emit_numeric(OP_SUBTRACT, OP_SUBTRACT_NN, left);
             break;
         case TOKEN_STAR:
-            emit_byte(OP_MULTIPLY);
+            emit_numeric(OP_MULTIPLY, OP_MULTIPLY_NN, left);
             break;
         case TOKEN_SLASH:
-            emit_byte(OP_DIVIDE);
+            emit_numeric(OP_DIVIDE, OP_DIVIDE_NN, left);
             break;
         default:
             UNREACHABLE();
     }
+    parser.type = type;
 }
 
 static void literal(UNUSED bool assignable) {
     switch (parser.previous.type) {
         case TOKEN_FALSE:
             emit_byte(OP_FALSE);
+            parser.type = STATIC_BOOL;
             break;
         case TOKEN_NIL:
             emit_byte(OP_NIL);
+            parser.type = STATIC_NIL;
             break;
         case TOKEN_TRUE:
             emit_byte(OP_TRUE);
+            parser.type = STATIC_BOOL;
             break;
         default:
             UNREACHABLE();
     }
 }
 
-bool compile(const char *source, Chunk *chunk) {
+Function *compile(const char *source) {
     init_scanner(source);
-    compiling_chunk = chunk;
+    Compiler compiler;
+    init_compiler(&compiler, TYPE_SCRIPT);
     parser.panic_mode = false;
     parser.had_error = false;
+    parser.condition = NULL;
+    current_class = NULL;
     advance();
     while (!match(TOKEN_EOF)) {
         declaration();
     }
-    end_compiler();
-    return !parser.had_error;
+    Function *function = end_compiler();
+    return parser.had_error ? NULL : function;
 }
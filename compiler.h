@@ -2,7 +2,8 @@
 #define COMPILER_H
 #include "vm.h"
 
-bool compile(const char *source, Chunk *chunk);
+// Returns the top-level script as a function, NULL on a compile error.
+Function *compile(const char *source);
 
 
 #endif
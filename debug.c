@@ -1,16 +1,33 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "debug.h"
 #include "chunk.h"
 #include "value.h"
+#include "vm.h"
+
+static const char *opcode_names[] = {
+#define OPCODE_NAME(name, operands) [OP_##name] = "OP_" #name,
+    OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+const char *opcode_name(uint8_t opcode) {
+    if (opcode >= sizeof(opcode_names) / sizeof(opcode_names[0])
+        || opcode_names[opcode] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcode_names[opcode];
+}
 
 void disassemble_chunk(Chunk *chunk, const char *name) {
+    flush_output(&vm.output);
     printf("== %s ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
         offset = disassemble_instruction(chunk, offset);
     }
 }
 
-int simple_instruction(const char *name, int offset) {
+int simple_instruction(const char *name, UNUSED Chunk *chunk, int offset) {
     printf("%s\n", name);
     return offset + 1;
 }
@@ -19,11 +36,82 @@ int constant_instruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
     print_value(chunk->constants.values[constant]);
+    flush_output(&vm.output);
     printf("'\n");
     return offset + 2; // one for the opcode, one for the operand
 }
 
+int byte_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 2;
+}
+
+int jump_instruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + jump);
+    return offset + 3;
+}
+
+int loop_instruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    uint16_t site = (uint16_t)(chunk->code[offset + 3] << 8);
+    site |= chunk->code[offset + 4];
+    printf("%-16s %4d -> %d (site %d)\n",
+        name, offset, offset + 5 - jump, site);
+    return offset + 5;
+}
+
+int property_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t site = (uint16_t)(chunk->code[offset + 2] << 8);
+    site |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    flush_output(&vm.output);
+    printf("' (site %d)\n", site);
+    return offset + 4;
+}
+
+int invoke_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t site = (uint16_t)(chunk->code[offset + 2] << 8);
+    site |= chunk->code[offset + 3];
+    uint8_t arg_count = chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, arg_count, constant);
+    print_value(chunk->constants.values[constant]);
+    flush_output(&vm.output);
+    printf("' (site %d)\n", site);
+    return offset + 5;
+}
+
+static int compare_hits(const void *a, const void *b) {
+    uint64_t hits_a = (*(const LoopSite **)a)->hits;
+    uint64_t hits_b = (*(const LoopSite **)b)->hits;
+    return (hits_a < hits_b) - (hits_a > hits_b);
+}
+
+void print_hot_loops(FILE *file, Chunk *chunk, const char *name) {
+    if (chunk->loop_count == 0) return;
+    LoopSite **sites = malloc(sizeof(LoopSite *) * chunk->loop_count);
+    for (int i = 0; i < chunk->loop_count; i++) {
+        sites[i] = &chunk->loops[i];
+    }
+    qsort(sites, chunk->loop_count, sizeof(LoopSite *), compare_hits);
+
+    fprintf(file, "== %s loops ==\n", name);
+    for (int i = 0; i < chunk->loop_count; i++) {
+        fprintf(file, "site %4d  line %4d  %12llu\n",
+            (int)(sites[i] - chunk->loops), chunk->lines[sites[i]->offset],
+            (unsigned long long)sites[i]->hits);
+    }
+    free(sites);
+}
+
 int disassemble_instruction(Chunk *chunk, int offset) {
+    flush_output(&vm.output);
     printf("%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
         printf("   | ");
@@ -34,42 +122,11 @@ int disassemble_instruction(Chunk *chunk, int offset) {
     uint8_t instruction = chunk->code[offset];
 
     switch (instruction) {
-        case OP_CONSTANT:
-            return constant_instruction("OP_CONSTANT", chunk, offset);
-        case OP_NEGATE:
-            return simple_instruction("OP_NEGATE", offset);
-        case OP_ADD:
-            return simple_instruction("OP_ADD", offset);
-        case OP_SUBTRACT:
-            return simple_instruction("OP_SUBTRACT", offset);
-        case OP_FALSE:
-            return simple_instruction("OP_FALSE", offset);
-        case OP_TRUE:
-            return simple_instruction("OP_TRUE", offset);
-        case OP_EQUAL:
-            return simple_instruction("OP_EQUAL", offset);
-        case OP_LESS:
-            return simple_instruction("OP_LESS", offset);
-        case OP_GREATER:
-            return simple_instruction("OP_GREATER", offset);
-        case OP_NIL:
-            return simple_instruction("OP_NIL", offset);
-        case OP_PRINT:
-            return simple_instruction("OP_PRINT", offset);
-        case OP_POP:
-            return simple_instruction("OP_POP", offset);
-        case OP_NOT:
-            return simple_instruction("OP_NOT", offset);
-        case OP_MULTIPLY:
-            return simple_instruction("OP_MULTIPLY", offset);
-        case OP_DIVIDE:
-            return simple_instruction("OP_DIVIDE", offset);
-        case OP_RETURN:
-            return simple_instruction("OP_RETURN", offset);
-        case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+#define DISASSEMBLE(name, operands) \
+        case OP_##name: \
+            return operands##_instruction("OP_" #name, chunk, offset);
+        OPCODES(DISASSEMBLE)
+#undef DISASSEMBLE
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -1,10 +1,13 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <stdio.h>
 #include "chunk.h"
 #include "value.h"
 
 void disassemble_chunk(Chunk *chunk, const char *name);
 int disassemble_instruction(Chunk *chunk, int offset);
+const char *opcode_name(uint8_t opcode);
+void print_hot_loops(FILE *file, Chunk *chunk, const char *name);
 
 #endif
@@ -0,0 +1,319 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "compiler.h"
+#include "debug.h"
+#include "flight.h"
+#include "object.h"
+#include "vm.h"
+
+// A dump is this header, the events oldest first and the sample ring as it
+// is in memory, so only the build that wrote it can decode it.
+typedef struct {
+    char magic[8];
+    uint32_t reason;
+    // events in the dump
+    uint32_t events;
+    uint32_t sample_capacity;
+    // events recorded in all
+    uint64_t count;
+    uint64_t sample_count;
+} FlightHeader;
+
+static const char flight_magic[8] = "CLOXFLT";
+
+FlightRecorder flight;
+static const char *dump_path;
+
+static const char *type_names[] = {
+    [VAL_NIL] = "nil",
+    [VAL_BOOL] = "bool",
+    [VAL_NUMBER] = "number",
+    [VAL_INT] = "int",
+    [VAL_OBJECT] = "object",
+    [VAL_SMALL_STRING] = "string"
+};
+
+void flight_sample_stack(uint32_t period) {
+    flight.sample_period = period;
+    flight.calls_to_sample = period;
+}
+
+void flight_count_call() {
+    if (--flight.calls_to_sample != 0) {
+        return;
+    }
+    flight.calls_to_sample = flight.sample_period;
+    FlightSample *sample =
+        &flight.samples[flight.sample_count++ & (FLIGHT_SAMPLES - 1)];
+    sample->event = flight.count;
+    sample->slots = (uint32_t)(vm.top - vm.stack);
+    sample->depth =
+        vm.frame_count > UINT16_MAX ? UINT16_MAX : (uint16_t)vm.frame_count;
+    for (int i = 0; i < FLIGHT_SAMPLE_SLOTS; i++) {
+        sample->types[i] = i < (int)sample->slots
+            ? (uint8_t)vm.top[-1 - i].type : UINT8_MAX;
+    }
+}
+
+static void handle_quit(UNUSED int signal) {
+    flight_dump(FLIGHT_SIGNAL);
+}
+
+bool set_flight_dump(const char *path) {
+    dump_path = path;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = path == NULL ? SIG_DFL : handle_quit;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGQUIT, &action, NULL) == 0;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+// whether `address` is in the code of `function`, and at which offset
+static bool find_offset(Function *function, uintptr_t address, size_t *offset) {
+    Chunk *chunk = &function->chunk;
+    uintptr_t code = (uintptr_t)chunk->code;
+    if (address >= code && address < code + chunk->count) {
+        *offset = address - code;
+        return true;
+    }
+#ifdef DISPATCH_THREADED
+    if (chunk->threaded != NULL
+        && address >= (uintptr_t)chunk->threaded
+        && address < (uintptr_t)(chunk->threaded + chunk->count)) {
+        *offset = (address - (uintptr_t)chunk->threaded)
+            / sizeof(ThreadedWord);
+        return true;
+    }
+#endif
+    return false;
+}
+
+// The function and offset of a recorded instruction address. Runs of
+// events mostly stay in one function, so `last` is tried first.
+static FlightEvent resolve(
+    FunctionTable *table, uint64_t entry, Function **last
+) {
+    uintptr_t address =
+        (uintptr_t)(entry & (((uint64_t)1 << FLIGHT_TYPE_SHIFT) - 1));
+    FlightEvent event = {
+        .function = UINT32_MAX,
+        .offset = 0,
+        .opcode = 0,
+        .type = (uint8_t)(entry >> FLIGHT_TYPE_SHIFT)
+    };
+    Function *function = *last;
+    size_t offset;
+    if (function == NULL || !find_offset(function, address, &offset)) {
+        function = NULL;
+        for (uint32_t i = 0; table != NULL && i < table->capacity; i++) {
+            Function *candidate = table->functions[i];
+            if (candidate != NULL && find_offset(candidate, address, &offset)) {
+                function = candidate;
+                break;
+            }
+        }
+        if (function == NULL) {
+            return event;
+        }
+        *last = function;
+    }
+    event.function = function->id;
+    event.offset = (uint32_t)offset;
+    event.opcode = function->chunk.code[offset];
+    return event;
+}
+
+void flight_dump(FlightReason reason) {
+    if (dump_path == NULL) {
+        return;
+    }
+    int fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    uint64_t first =
+        flight.count > FLIGHT_EVENTS ? flight.count - FLIGHT_EVENTS : 0;
+    FlightHeader header;
+    memcpy(header.magic, flight_magic, sizeof(header.magic));
+    header.reason = reason;
+    header.events = (uint32_t)(flight.count - first);
+    header.sample_capacity = FLIGHT_SAMPLES;
+    header.count = flight.count;
+    header.sample_count = flight.sample_count;
+    bool written = write_all(fd, &header, sizeof(header));
+
+    // no allocation, this may run in a signal handler
+    FunctionTable *table = vm.functions;
+    Function *last = NULL;
+    FlightEvent buffer[64];
+    int buffered = 0;
+    for (uint64_t i = first; written && i < flight.count; i++) {
+        buffer[buffered++] = resolve(
+            table, flight.events[i & (FLIGHT_EVENTS - 1)], &last
+        );
+        if (buffered == 64 || i + 1 == flight.count) {
+            written = write_all(fd, buffer, sizeof(FlightEvent) * buffered);
+            buffered = 0;
+        }
+    }
+    if (written) {
+        write_all(fd, flight.samples, sizeof(flight.samples));
+    }
+    close(fd);
+}
+
+// Offline decoding
+
+static const char *type_name(uint8_t type) {
+    return type <= VAL_SMALL_STRING ? type_names[type] : "?";
+}
+
+static void print_event(Function **functions, FlightEvent *event, int depth) {
+    if (event->function == UINT32_MAX) {
+        printf("%5d %-7s ?\n", depth, type_name(event->type));
+        return;
+    }
+    Function *function = functions[event->function];
+    const char *name = function->name == NULL
+        ? "script" : string_cstring(function->name);
+    Chunk *chunk = &function->chunk;
+    printf("%5d %-7s %-12s %4d ", depth, type_name(event->type), name,
+        chunk->lines[event->offset]);
+    // show the instruction as it ran, quickened or not; both forms take
+    // the same operands
+    uint8_t opcode = chunk->code[event->offset];
+    chunk->code[event->offset] = event->opcode;
+    disassemble_instruction(chunk, event->offset);
+    chunk->code[event->offset] = opcode;
+}
+
+// the instructions whose events are calls that push a frame
+static bool enters_frame(uint8_t opcode) {
+    return opcode == OP_CALL || opcode == OP_INVOKE
+        || opcode == OP_SUPER_INVOKE;
+}
+
+static bool event_fits(Function **functions, uint32_t count, FlightEvent *e) {
+    if (e->function == UINT32_MAX) {
+        return true;
+    }
+    if (e->function >= count || functions[e->function] == NULL) {
+        return false;
+    }
+    Chunk *chunk = &functions[e->function]->chunk;
+    if (e->offset >= (uint32_t)chunk->count || e->opcode >= OPCODE_COUNT) {
+        return false;
+    }
+    // calls, returns and loops are never quickened, anything else may have
+    // been rewritten into a form with the same operands
+    uint8_t compiled = chunk->code[e->offset];
+    switch (e->opcode) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_RETURN:
+        case OP_LOOP:
+            return compiled == e->opcode;
+        default:
+            return instruction_length(compiled) == instruction_length(e->opcode);
+    }
+}
+
+static void print_samples(FlightSample *samples, uint64_t sample_count) {
+    uint64_t first =
+        sample_count > FLIGHT_SAMPLES ? sample_count - FLIGHT_SAMPLES : 0;
+    if (first == sample_count) {
+        return;
+    }
+    printf("\nstack samples\n");
+    for (uint64_t i = first; i < sample_count; i++) {
+        FlightSample *sample = &samples[i & (FLIGHT_SAMPLES - 1)];
+        printf("after event %llu: %u slots in %u frames, top:",
+            (unsigned long long)sample->event, sample->slots, sample->depth);
+        for (int slot = 0; slot < FLIGHT_SAMPLE_SLOTS; slot++) {
+            if (sample->types[slot] == UINT8_MAX) break;
+            printf(" %s", type_name(sample->types[slot]));
+        }
+        printf("\n");
+    }
+}
+
+bool decode_flight(const char *path, const char *source) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open \"%s\".\n", path);
+        return false;
+    }
+    FlightHeader header;
+    static FlightEvent events[FLIGHT_EVENTS];
+    static FlightSample samples[FLIGHT_SAMPLES];
+    bool read = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, flight_magic, sizeof(header.magic)) == 0
+        && header.events <= FLIGHT_EVENTS
+        && header.sample_capacity == FLIGHT_SAMPLES
+        && fread(events, sizeof(FlightEvent), header.events, file)
+            == header.events
+        && fread(samples, sizeof(samples), 1, file) == 1;
+    fclose(file);
+    if (!read) {
+        fprintf(stderr, "\"%s\" is not a flight recording of this build.\n",
+            path);
+        return false;
+    }
+
+    if (compile(source) == NULL) {
+        return false;
+    }
+    Function **functions = vm.functions->functions;
+    uint32_t function_count = vm.functions->capacity;
+
+    bool fits = true;
+    for (uint32_t i = 0; i < header.events && fits; i++) {
+        fits = event_fits(functions, function_count, &events[i]);
+    }
+    if (!fits) {
+        fprintf(stderr, "The recording does not match this script.\n");
+        return false;
+    }
+
+    // call depth relative to the shallowest point in the recording
+    int depth = 0;
+    int lowest = 0;
+    for (uint32_t i = 0; i < header.events; i++) {
+        if (enters_frame(events[i].opcode)) depth++;
+        if (events[i].opcode == OP_RETURN) depth--;
+        if (depth < lowest) lowest = depth;
+    }
+    printf("%s after %llu events, the last %u of them:\n",
+        header.reason == FLIGHT_SIGNAL ? "SIGQUIT" : "runtime error",
+        (unsigned long long)header.count, header.events);
+    printf("%5s %-7s %-12s %4s instruction\n",
+        "depth", "top", "function", "line");
+    depth = -lowest;
+    for (uint32_t i = 0; i < header.events; i++) {
+        print_event(functions, &events[i], depth);
+        if (enters_frame(events[i].opcode)) depth++;
+        if (events[i].opcode == OP_RETURN) depth--;
+    }
+    print_samples(samples, header.sample_count);
+    return true;
+}
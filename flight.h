@@ -0,0 +1,91 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include "common.h"
+#include "value.h"
+
+// The flight recorder keeps the most recent control transfers (calls,
+// returns and loop back-edges) in a ring buffer, plus the instruction
+// that raised a runtime error. Straight-line code between two events is
+// not recorded, which keeps it cheap enough to leave on in release builds.
+// With a dump path set the ring is written to that file on a runtime error
+// or SIGQUIT; `clox --decode-flight dump script` renders a dump, given the
+// script that produced it.
+
+// events kept, a power of two
+#define FLIGHT_EVENTS 4096
+// stack samples kept, a power of two
+#define FLIGHT_SAMPLES 16
+// slots described by a stack sample, counted from the top
+#define FLIGHT_SAMPLE_SLOTS 8
+
+// How a dump stores an event. In memory an event is a single word, see
+// flight_record().
+typedef struct {
+    // Function.id, the same when the script is compiled again; UINT32_MAX
+    // if the instruction could not be found
+    uint32_t function;
+    // of the opcode
+    uint32_t offset;
+    uint8_t opcode;
+    // ValueType on top of the stack
+    uint8_t type;
+} FlightEvent;
+
+typedef struct {
+    // events recorded before the sample was taken
+    uint64_t event;
+    uint32_t slots;
+    uint16_t depth;
+    // ValueType of the topmost slots, top first
+    uint8_t types[FLIGHT_SAMPLE_SLOTS];
+} FlightSample;
+
+// user space addresses leave the top byte free for the value type
+#define FLIGHT_TYPE_SHIFT 56
+
+typedef struct {
+    uint64_t count;
+    // the address of the instruction, in a chunk's code or threaded code,
+    // with the ValueType on top of the stack in the top byte
+    uint64_t events[FLIGHT_EVENTS];
+    uint64_t sample_count;
+    // calls between stack samples, 0 takes none
+    uint32_t sample_period;
+    uint32_t calls_to_sample;
+    FlightSample samples[FLIGHT_SAMPLES];
+} FlightRecorder;
+
+typedef enum {
+    FLIGHT_RUNTIME_ERROR,
+    FLIGHT_SIGNAL
+} FlightReason;
+
+extern FlightRecorder flight;
+
+// One store, the instruction is only looked up when the ring is dumped.
+static inline void flight_record(const void *instruction, ValueType type) {
+    flight.events[flight.count++ & (FLIGHT_EVENTS - 1)] =
+        (uint64_t)(uintptr_t)instruction
+        | ((uint64_t)type << FLIGHT_TYPE_SHIFT);
+}
+
+// Records the stack every `period` calls, 0 stops it.
+void flight_sample_stack(uint32_t period);
+// Counts a call while stack sampling is on and takes a sample every
+// sample_period of them; the interpreter state has to be spilled.
+void flight_count_call();
+
+// Where dumps go, NULL for nowhere. Also installs the SIGQUIT handler, the
+// dump is written and the program keeps running. Returns false if the
+// handler could not be installed.
+bool set_flight_dump(const char *path);
+// Writes the recorder to the dump path, if there is one. Only uses
+// async-signal-safe calls.
+void flight_dump(FlightReason reason);
+
+// Prints the dump at `path` against the functions compiled from `source`.
+// Returns false if the dump can not be read or does not fit the source.
+bool decode_flight(const char *path, const char *source);
+
+#endif
@@ -0,0 +1,472 @@
+// The opcode handlers, written once for every dispatch engine in vm.c.
+// This is not a normal header: vm.c includes it where the engine wants its
+// handlers, after defining HANDLER(), DISPATCH(), the operand readers and
+// the state the handlers work on (`ip`, `sp`, `tos`, `frame`, `slots`).
+
+HANDLER(CONSTANT) {
+    PUSH(READ_CONSTANT());
+    DISPATCH();
+}
+
+HANDLER(PRINT) {
+    print_value(tos);
+    write_output(&vm.output, "\n", 1);
+    DROP();
+    DISPATCH();
+}
+
+HANDLER(POP) {
+    DROP();
+    DISPATCH();
+}
+
+HANDLER(NEGATE) {
+    if (!IS_NUMBER(tos)) {
+        RUNTIME_ERROR("Operand must be a number.");
+    }
+    tos = negate_number(tos);
+    DISPATCH();
+}
+
+HANDLER(DEFINE_GLOBAL) {
+    String *name = AS_STRING(READ_CONSTANT());
+    table_set(&vm.globals, name, intern_value(tos));
+    DROP();
+    DISPATCH();
+}
+
+HANDLER(GET_GLOBAL) {
+    String *name = AS_STRING(READ_CONSTANT());
+    int slot = table_index(&vm.globals, name);
+    if (slot < 0) {
+        RUNTIME_ERROR("Undefined variable '%s'.", string_cstring(name));
+    }
+    int offset = CODE_OFFSET() - 2;
+    if (can_specialize(&frame->function->chunk, offset)) {
+        inline_cache(&frame->function->chunk, offset)->slot = slot;
+        REWRITE(offset, OP_GET_GLOBAL_CACHED);
+    }
+    PUSH(vm.globals.values[slot]);
+    DISPATCH();
+}
+
+HANDLER(GET_GLOBAL_CACHED) {
+    String *name = AS_STRING(READ_CONSTANT());
+    InlineCache *cache = &frame->function->chunk.caches[CODE_OFFSET() - 2];
+    if UNLIKELY(cache->slot >= vm.globals.capacity
+        || vm.globals.keys[cache->slot] != OBJECT_REF(name)) {
+        // the table was rehashed since, look the global up again
+        int slot = table_index(&vm.globals, name);
+        if (slot < 0) {
+            RUNTIME_ERROR("Undefined variable '%s'.", string_cstring(name));
+        }
+        cache->slot = slot;
+    }
+    PUSH(vm.globals.values[cache->slot]);
+    DISPATCH();
+}
+
+HANDLER(SET_GLOBAL) {
+    String *name = AS_STRING(READ_CONSTANT());
+    tos = intern_value(tos);
+    if (table_set(&vm.globals, name, tos)) {
+        table_delete(&vm.globals, name);
+        RUNTIME_ERROR("Undefined variable '%s'.", string_cstring(name));
+    }
+    DISPATCH();
+}
+
+HANDLER(GET_LOCAL) {
+    PUSH(slots[READ_BYTE()]);
+    DISPATCH();
+}
+
+HANDLER(SET_LOCAL) {
+    slots[READ_BYTE()] = tos;
+    DISPATCH();
+}
+
+HANDLER(JUMP) {
+    uint16_t offset = READ_SHORT();
+    ip += offset;
+    DISPATCH();
+}
+
+HANDLER(JUMP_IF_FALSE) {
+    uint16_t offset = READ_SHORT();
+    Value condition = tos;
+    DROP();
+    if (is_false(condition)) ip += offset;
+    DISPATCH();
+}
+
+HANDLER(JUMP_IF_TRUE) {
+    uint16_t offset = READ_SHORT();
+    Value condition = tos;
+    DROP();
+    if (!is_false(condition)) ip += offset;
+    DISPATCH();
+}
+
+HANDLER(JUMP_IF_FALSE_OR_POP) {
+    uint16_t offset = READ_SHORT();
+    if (is_false(tos)) {
+        ip += offset;
+    } else {
+        DROP();
+    }
+    DISPATCH();
+}
+
+HANDLER(JUMP_IF_TRUE_OR_POP) {
+    uint16_t offset = READ_SHORT();
+    if (!is_false(tos)) {
+        ip += offset;
+    } else {
+        DROP();
+    }
+    DISPATCH();
+}
+
+HANDLER(LOOP) {
+    uint16_t offset = READ_SHORT();
+    uint16_t site = READ_SHORT();
+    LOOP_SITES()[site].hits++;
+    RECORD(5);
+    ip -= offset;
+    SAFE_POINT();
+    DISPATCH();
+}
+
+HANDLER(TRUE) {
+    PUSH(BOOL_VAL(true));
+    DISPATCH();
+}
+
+HANDLER(FALSE) {
+    PUSH(BOOL_VAL(false));
+    DISPATCH();
+}
+
+HANDLER(NIL) {
+    PUSH(NIL_VAL);
+    DISPATCH();
+}
+
+HANDLER(NOT) {
+    tos = BOOL_VAL(is_false(tos));
+    DISPATCH();
+}
+
+HANDLER(EQUAL) {
+    sp--;
+    tos = BOOL_VAL(is_equal(*sp, tos));
+    DISPATCH();
+}
+
+HANDLER(GREATER) {
+    BINARY_OP(greater_numbers);
+}
+
+HANDLER(LESS) {
+    BINARY_OP(less_numbers);
+}
+
+HANDLER(ADD) {
+    Value a = sp[-1];
+    if (IS_STRING(a) && IS_STRING(tos)) {
+        SPECIALIZE(1, OP_ADD_STRING);
+        sp--;
+        tos = concatenate(a, tos);
+        DISPATCH();
+    } else if (IS_NUMBER(a) && IS_NUMBER(tos)) {
+        SPECIALIZE(1, OP_ADD_NUMBER);
+        sp--;
+        tos = add_numbers(a, tos);
+        DISPATCH();
+    } else {
+        RUNTIME_ERROR("Only strings or numbers are allowed.");
+    }
+}
+
+HANDLER(ADD_NUMBER) {
+    Value a = sp[-1];
+    if UNLIKELY(!IS_NUMBER(a) || !IS_NUMBER(tos)) {
+        DEOPTIMIZE(1, OP_ADD);
+    }
+    sp--;
+    tos = add_numbers(a, tos);
+    DISPATCH();
+}
+
+HANDLER(ADD_STRING) {
+    Value a = sp[-1];
+    if UNLIKELY(!IS_STRING(a) || !IS_STRING(tos)) {
+        DEOPTIMIZE(1, OP_ADD);
+    }
+    sp--;
+    tos = concatenate(a, tos);
+    DISPATCH();
+}
+
+HANDLER(SUBTRACT) {
+    BINARY_OP(subtract_numbers);
+}
+
+HANDLER(MULTIPLY) {
+    BINARY_OP(multiply_numbers);
+}
+
+HANDLER(DIVIDE) {
+    BINARY_OP(divide_numbers);
+}
+
+HANDLER(ADD_NN) {
+    NUMBER_OP(add_numbers);
+}
+
+HANDLER(SUBTRACT_NN) {
+    NUMBER_OP(subtract_numbers);
+}
+
+HANDLER(MULTIPLY_NN) {
+    NUMBER_OP(multiply_numbers);
+}
+
+HANDLER(DIVIDE_NN) {
+    NUMBER_OP(divide_numbers);
+}
+
+HANDLER(GREATER_NN) {
+    NUMBER_OP(greater_numbers);
+}
+
+HANDLER(LESS_NN) {
+    NUMBER_OP(less_numbers);
+}
+
+HANDLER(CALL) {
+    int arg_count = READ_BYTE();
+    SPILL();
+    if (!call(vm.top[-1 - arg_count], arg_count, 2)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    // a function's arguments stay where they are, a native has replaced
+    // them with its result
+    sp = vm.top - 1;
+    tos = *sp;
+    LOAD_FRAME();
+    SAFE_POINT();
+    DISPATCH();
+}
+
+HANDLER(TAIL_CALL) {
+    int arg_count = READ_BYTE();
+    SPILL();
+    if (!tail_call(vm.top[-1 - arg_count], arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    sp = vm.top - 1;
+    tos = *sp;
+    LOAD_FRAME();
+    DISPATCH();
+}
+
+HANDLER(BUILD_LIST) {
+    int count = READ_BYTE();
+    // the elements are the top `count` slots, the last one in `tos`
+    *sp = tos;
+    sp -= count - 1;
+    tos = OBJECT_VAL(list_from(sp, count));
+    DISPATCH();
+}
+
+HANDLER(GET_INDEX) {
+    Value target = sp[-1];
+    if (IS_MAP(target)) {
+        int index = map_index(AS_MAP(target), tos);
+        if UNLIKELY(index < 0) {
+            RUNTIME_ERROR("Undefined key.");
+        }
+        sp--;
+        tos = AS_MAP(target)->table.values[index];
+        DISPATCH();
+    }
+    const char *error = check_index(target, tos);
+    if UNLIKELY(error != NULL) {
+        RUNTIME_ERROR("%s", error);
+    }
+    sp--;
+    tos = AS_LIST(*sp)->values[AS_INT(tos)];
+    DISPATCH();
+}
+
+HANDLER(SET_INDEX) {
+    Value target = sp[-2];
+    if (IS_MAP(target)) {
+        map_set(AS_MAP(target), sp[-1], tos);
+        sp -= 2;
+        DISPATCH();
+    }
+    const char *error = check_index(target, sp[-1]);
+    if UNLIKELY(error != NULL) {
+        RUNTIME_ERROR("%s", error);
+    }
+    // the assigned value stays as the result
+    AS_LIST(target)->values[AS_INT(sp[-1])] = tos;
+    sp -= 2;
+    DISPATCH();
+}
+
+HANDLER(BUILD_MAP) {
+    int count = READ_BYTE();
+    // keys and values alternate in the top 2 * `count` slots, the last
+    // value in `tos`
+    *sp = tos;
+    sp -= 2 * count - 1;
+    tos = OBJECT_VAL(map_from(sp, count));
+    DISPATCH();
+}
+
+HANDLER(DELETE) {
+    Value target = sp[-1];
+    if (!IS_MAP(target)) {
+        RUNTIME_ERROR("Can only delete map entries.");
+    }
+    sp--;
+    tos = BOOL_VAL(map_delete(AS_MAP(target), tos));
+    DISPATCH();
+}
+
+HANDLER(CONTAINS) {
+    Value key = sp[-1];
+    if (IS_MAP(tos)) {
+        sp--;
+        tos = BOOL_VAL(map_contains(AS_MAP(tos), key));
+        DISPATCH();
+    }
+    if (IS_LIST(tos)) {
+        sp--;
+        tos = BOOL_VAL(list_contains(AS_LIST(tos), key));
+        DISPATCH();
+    }
+    RUNTIME_ERROR("Only lists and maps can be searched with 'in'.");
+}
+
+HANDLER(CLASS) {
+    PUSH(OBJECT_VAL(new_class(AS_STRING(READ_CONSTANT()))));
+    DISPATCH();
+}
+
+HANDLER(INHERIT) {
+    if (!IS_CLASS(tos)) {
+        RUNTIME_ERROR("Superclass must be a class.");
+    }
+    class_inherit(AS_CLASS(sp[-1]), AS_CLASS(tos));
+    DROP();
+    DISPATCH();
+}
+
+HANDLER(METHOD) {
+    String *name = AS_STRING(READ_CONSTANT());
+    class_add_method(AS_CLASS(sp[-1]), name, AS_FUNCTION(tos));
+    DROP();
+    DISPATCH();
+}
+
+HANDLER(GET_PROPERTY) {
+    String *name = AS_STRING(READ_CONSTANT());
+    PropertyCache *cache = READ_CACHE();
+    if LIKELY(IS_INSTANCE(tos)) {
+        Instance *instance = AS_INSTANCE(tos);
+        PropertyWay *way = cached_way(cache, instance->shape);
+        if LIKELY(way != NULL && way->slot >= 0) {
+            tos = instance->fields[way->slot];
+            DISPATCH();
+        }
+    }
+    SPILL();
+    if (!get_property(sp, name, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    tos = *sp;
+    DISPATCH();
+}
+
+HANDLER(SET_PROPERTY) {
+    String *name = AS_STRING(READ_CONSTANT());
+    PropertyCache *cache = READ_CACHE();
+    Value target = sp[-1];
+    if LIKELY(IS_INSTANCE(target)) {
+        Instance *instance = AS_INSTANCE(target);
+        PropertyWay *way = cached_way(cache, instance->shape);
+        if LIKELY(way != NULL && way->slot < instance->capacity) {
+            instance->shape = (Shape *)way->target;
+            instance->fields[way->slot] = tos;
+            // the assigned value stays as the result
+            sp--;
+            DISPATCH();
+        }
+    }
+    SPILL();
+    if (!set_property(sp, name, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    sp--;
+    DISPATCH();
+}
+
+HANDLER(INVOKE) {
+    String *name = AS_STRING(READ_CONSTANT());
+    PropertyCache *cache = READ_CACHE();
+    int arg_count = READ_BYTE();
+    SPILL();
+    if (!invoke(name, cache, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    sp = vm.top - 1;
+    tos = *sp;
+    LOAD_FRAME();
+    DISPATCH();
+}
+
+HANDLER(GET_SUPER) {
+    String *name = AS_STRING(READ_CONSTANT());
+    PropertyCache *cache = READ_CACHE();
+    SPILL();
+    if (!get_super(sp, name, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    tos = *sp;
+    DISPATCH();
+}
+
+HANDLER(SUPER_INVOKE) {
+    String *name = AS_STRING(READ_CONSTANT());
+    PropertyCache *cache = READ_CACHE();
+    int arg_count = READ_BYTE();
+    SPILL();
+    if (!super_invoke(name, cache, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    sp = vm.top - 1;
+    tos = *sp;
+    LOAD_FRAME();
+    DISPATCH();
+}
+
+HANDLER(RETURN) {
+    RECORD(1);
+    Value result = tos;
+    vm.frame_count--;
+    if (vm.frame_count == 0) {
+        // drop the script along with the result
+        vm.top = slots;
+        return INTERPRET_OK;
+    }
+    sp = slots;
+    tos = result;
+    LOAD_FRAME();
+    SAFE_POINT();
+    DISPATCH();
+}
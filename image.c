@@ -0,0 +1,627 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cage.h"
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+// older headers; kernels that predate it take the address as a hint
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define IMAGE_ALIGNMENT 8
+// the address images are laid out for
+#define IMAGE_BASE ((uint64_t)1 << 40)
+#ifdef HEAP_CAGE
+// the cage offset they are laid out for, well past what init_vm() takes
+#define IMAGE_CAGE_OFFSET ((size_t)1 << 24)
+#else
+#define IMAGE_CAGE_OFFSET 0
+#endif
+
+char *image_start = NULL;
+size_t image_size = 0;
+
+// Lists of uint32_t offsets into the image, written after everything else.
+typedef enum {
+    // 64-bit pointers
+    LIST_POINTERS,
+    // 32-bit cage references
+    LIST_REFS,
+    // natives, whose functions are looked up again by name
+    LIST_NATIVES,
+    // maps with keys hashed by their address, placed again on loading
+    LIST_MAPS,
+    LIST_COUNT
+} ImageList;
+
+typedef struct {
+    char magic[8];
+    uint32_t layout;
+    uint32_t next_function_id;
+    // of the whole file, all of it is mapped
+    uint64_t size;
+    // where offset 0 was laid out for, and with HEAP_CAGE its cage offset
+    uint64_t base;
+    uint64_t cage_offset;
+    // the chain of objects, linked in front of vm.objects on loading
+    uint64_t first;
+    uint64_t last;
+    uint64_t lists[LIST_COUNT];
+    uint32_t counts[LIST_COUNT];
+    Table strings;
+    Table globals;
+} ImageHeader;
+
+static const char image_magic[8] = "CLOXIMG";
+
+// changes with the layout of anything an image holds
+static uint32_t image_layout() {
+    static const size_t sizes[] = {
+        sizeof(Value), sizeof(ObjectRef), sizeof(String), sizeof(Function),
+        sizeof(Native), sizeof(List), sizeof(Map), sizeof(Class),
+        sizeof(Shape), sizeof(Instance), sizeof(BoundMethod), sizeof(Table),
+        sizeof(InlineCache), sizeof(PropertyCache), sizeof(LoopSite),
+        OPCODE_COUNT
+    };
+    uint32_t layout = 2166136261u;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        layout = (layout ^ (uint32_t)sizes[i]) * 16777619;
+    }
+    return layout;
+}
+
+static size_t object_size(Object *object) {
+    switch (object->type) {
+        case STRING:
+            return sizeof(String) + ((String *)object)->length + 1;
+        case FUNCTION: return sizeof(Function);
+        case NATIVE: return sizeof(Native);
+        case LIST: return sizeof(List);
+        case MAP: return sizeof(Map);
+        case CLASS: return sizeof(Class);
+        case SHAPE: return sizeof(Shape);
+        case INSTANCE: return sizeof(Instance);
+        case BOUND_METHOD: return sizeof(BoundMethod);
+    }
+    UNREACHABLE();
+}
+
+// Writing: the image is put together in memory, laid out for IMAGE_BASE.
+// Every object is copied and its pointers are translated to where the
+// object lands; the arrays objects own follow after all the objects.
+
+typedef struct {
+    Object *object;
+    uint32_t offset;
+} Placement;
+
+typedef struct {
+    uint32_t *offsets;
+    int count;
+    int capacity;
+} OffsetList;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    // sorted by address
+    Placement *placements;
+    int placement_count;
+    OffsetList lists[LIST_COUNT];
+} Writer;
+
+// a field of the struct at `at` in the image, only good until it grows
+#define FIELD(writer, type, at, field) (((type *)((writer)->data + (at)))->field)
+
+// `size` zeroed bytes, aligned
+static size_t reserve(Writer *writer, size_t size) {
+    size_t offset = (writer->size + IMAGE_ALIGNMENT - 1)
+        & ~(size_t)(IMAGE_ALIGNMENT - 1);
+    if (offset + size > writer->capacity) {
+        size_t old_capacity = writer->capacity;
+        size_t capacity = old_capacity < 4096 ? 4096 : 2 * old_capacity;
+        while (capacity < offset + size) capacity *= 2;
+        writer->data = GROW_ARRAY(
+            char, writer->data, old_capacity, capacity, MEM_IMAGE
+        );
+        writer->capacity = capacity;
+    }
+    memset(writer->data + writer->size, 0, offset + size - writer->size);
+    writer->size = offset + size;
+    return offset;
+}
+
+static size_t append(Writer *writer, const void *data, size_t size) {
+    size_t offset = reserve(writer, size);
+    memcpy(writer->data + offset, data, size);
+    return offset;
+}
+
+static void add_offset(Writer *writer, ImageList list, size_t offset) {
+    OffsetList *offsets = &writer->lists[list];
+    if (offsets->capacity < offsets->count + 1) {
+        int old_capacity = offsets->capacity;
+        offsets->capacity = old_capacity < 64 ? 64 : 2 * old_capacity;
+        offsets->offsets = GROW_ARRAY(
+            uint32_t, offsets->offsets, old_capacity, offsets->capacity,
+            MEM_IMAGE
+        );
+    }
+    offsets->offsets[offsets->count++] = (uint32_t)offset;
+}
+
+static int compare_placements(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)((const Placement *)a)->object;
+    uintptr_t y = (uintptr_t)((const Placement *)b)->object;
+    return (x > y) - (x < y);
+}
+
+static uint32_t object_offset(Writer *writer, Object *object) {
+    int low = 0;
+    int high = writer->placement_count - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        Placement *placement = &writer->placements[middle];
+        if (placement->object == object) {
+            return placement->offset;
+        }
+        if ((uintptr_t)placement->object < (uintptr_t)object) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    // everything is on vm.objects
+    UNREACHABLE();
+}
+
+// the pointer at `at` to offset `target` of the image
+static void put_address(Writer *writer, size_t at, size_t target) {
+    uint64_t address = IMAGE_BASE + target;
+    memcpy(writer->data + at, &address, sizeof(address));
+    add_offset(writer, LIST_POINTERS, at);
+}
+
+static void put_pointer(Writer *writer, size_t at, const void *object) {
+    if (object == NULL) {
+        memset(writer->data + at, 0, sizeof(void *));
+        return;
+    }
+    put_address(writer, at, object_offset(writer, (Object *)object));
+}
+
+static void put_ref(Writer *writer, size_t at, ObjectRef ref) {
+#ifdef HEAP_CAGE
+    uint32_t offset = 0;
+    if (ref != NULL_REF) {
+        offset = (uint32_t)IMAGE_CAGE_OFFSET
+            + object_offset(writer, OBJECT_PTR(ref));
+        add_offset(writer, LIST_REFS, at);
+    }
+    memcpy(writer->data + at, &offset, sizeof(offset));
+#else
+    put_pointer(writer, at, ref);
+#endif
+}
+
+static void put_value(Writer *writer, size_t at, Value value) {
+    memcpy(writer->data + at, &value, sizeof(Value));
+    if (IS_OBJECT(value)) {
+        put_pointer(writer, at + offsetof(Value, as), AS_OBJECT(value));
+    }
+}
+
+// copies of `count` values, the pointer at `at` to them
+static void put_values(Writer *writer, size_t at, Value *values, int count) {
+    if (values == NULL || count == 0) {
+        memset(writer->data + at, 0, sizeof(Value *));
+        return;
+    }
+    size_t array = reserve(writer, sizeof(Value) * count);
+    for (int i = 0; i < count; i++) {
+        put_value(writer, array + i * sizeof(Value), values[i]);
+    }
+    put_address(writer, at, array);
+}
+
+static void put_bytes(Writer *writer, size_t at, const void *data, size_t size) {
+    if (data == NULL || size == 0) {
+        memset(writer->data + at, 0, sizeof(void *));
+        return;
+    }
+    put_address(writer, at, append(writer, data, size));
+}
+
+// for a copy of `table` at `at`
+static void put_table(Writer *writer, size_t at, Table *table) {
+    if (table->capacity == 0) {
+        return;
+    }
+    size_t keys = reserve(writer, sizeof(ObjectRef) * table->capacity);
+    for (int i = 0; i < table->capacity; i++) {
+        put_ref(writer, keys + i * sizeof(ObjectRef), table->keys[i]);
+    }
+    put_address(writer, at + offsetof(Table, keys), keys);
+    put_values(
+        writer, at + offsetof(Table, values), table->values, table->capacity
+    );
+}
+
+// for a copy of `chunk` at `at`; the arrays are cut to what is in use and
+// the counters and caches filled in while running start over
+static void put_chunk(Writer *writer, size_t at, Chunk *chunk) {
+    FIELD(writer, Chunk, at, capacity) = chunk->count;
+    put_bytes(writer, at + offsetof(Chunk, code), chunk->code, chunk->count);
+    put_bytes(writer, at + offsetof(Chunk, lines), chunk->lines,
+        sizeof(int) * chunk->count);
+
+    size_t constants = at + offsetof(Chunk, constants);
+    FIELD(writer, ValueArray, constants, capacity) = chunk->constants.count;
+    put_values(writer, constants + offsetof(ValueArray, values),
+        chunk->constants.values, chunk->constants.count);
+
+    FIELD(writer, Chunk, at, loop_capacity) = chunk->loop_count;
+    if (chunk->loop_count > 0) {
+        size_t loops = append(writer, chunk->loops,
+            sizeof(LoopSite) * chunk->loop_count);
+        for (int i = 0; i < chunk->loop_count; i++) {
+            ((LoopSite *)(writer->data + loops))[i].hits = 0;
+        }
+        put_address(writer, at + offsetof(Chunk, loops), loops);
+    } else {
+        FIELD(writer, Chunk, at, loops) = NULL;
+    }
+
+    FIELD(writer, Chunk, at, property_capacity) = chunk->property_count;
+    if (chunk->property_count > 0) {
+        put_address(writer, at + offsetof(Chunk, properties),
+            reserve(writer, sizeof(PropertyCache) * chunk->property_count));
+    } else {
+        FIELD(writer, Chunk, at, properties) = NULL;
+    }
+    // quickened instructions find their state here
+    put_bytes(writer, at + offsetof(Chunk, caches), chunk->caches,
+        chunk->caches == NULL ? 0 : sizeof(InlineCache) * chunk->count);
+    FIELD(writer, Chunk, at, coverage) = NULL;
+    // loaded arrays are freed one by one, like before freezing
+    FIELD(writer, Chunk, at, frozen) = NULL;
+#ifdef DISPATCH_THREADED
+    FIELD(writer, Chunk, at, threaded) = NULL;
+#endif
+}
+
+static bool has_address_keys(Map *map) {
+    for (int i = 0; i < map->table.capacity; i++) {
+        Value key = map->table.keys[i];
+        if (IS_OBJECT(key) && !is_objecttype(key, STRING)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void put_object(Writer *writer, size_t at, Object *object, Object *next) {
+    // a borrowed string's characters are copied in below
+    memcpy(writer->data + at, object,
+        object->type == STRING ? sizeof(String) : object_size(object));
+    put_ref(writer, at + offsetof(Object, next),
+        next == NULL ? NULL_REF : OBJECT_REF(next));
+    switch (object->type) {
+        case STRING: {
+            String *string = (String *)object;
+            FIELD(writer, String, at, object.flags) &=
+                ~(STRING_BORROWED | STRING_RELEASED);
+            memcpy(FIELD(writer, String, at, data), string_chars(string),
+                string->length);
+            break;
+        }
+        case FUNCTION: {
+            Function *function = (Function *)object;
+            put_pointer(writer, at + offsetof(Function, name), function->name);
+            put_chunk(writer, at + offsetof(Function, chunk), &function->chunk);
+            break;
+        }
+        case NATIVE: {
+            Native *native = (Native *)object;
+            put_pointer(writer, at + offsetof(Native, name), native->name);
+            FIELD(writer, Native, at, function) = NULL;
+            add_offset(writer, LIST_NATIVES, at);
+            break;
+        }
+        case LIST: {
+            List *list = (List *)object;
+            FIELD(writer, List, at, capacity) = list->count;
+            put_values(writer, at + offsetof(List, values),
+                list->values, list->count);
+            break;
+        }
+        case MAP: {
+            Map *map = (Map *)object;
+            size_t table = at + offsetof(Map, table);
+            put_values(writer, table + offsetof(ValueTable, keys),
+                map->table.keys, map->table.capacity);
+            put_values(writer, table + offsetof(ValueTable, values),
+                map->table.values, map->table.capacity);
+            if (has_address_keys(map)) {
+                add_offset(writer, LIST_MAPS, at);
+            }
+            break;
+        }
+        case CLASS: {
+            Class *klass = (Class *)object;
+            put_pointer(writer, at + offsetof(Class, name), klass->name);
+            put_pointer(
+                writer, at + offsetof(Class, superclass), klass->superclass
+            );
+            put_table(writer, at + offsetof(Class, methods), &klass->methods);
+            put_pointer(
+                writer, at + offsetof(Class, initializer), klass->initializer
+            );
+            put_pointer(writer, at + offsetof(Class, shape), klass->shape);
+            break;
+        }
+        case SHAPE: {
+            Shape *shape = (Shape *)object;
+            put_pointer(writer, at + offsetof(Shape, klass), shape->klass);
+            put_pointer(writer, at + offsetof(Shape, parent), shape->parent);
+            put_pointer(writer, at + offsetof(Shape, name), shape->name);
+            put_table(
+                writer, at + offsetof(Shape, transitions), &shape->transitions
+            );
+            break;
+        }
+        case INSTANCE: {
+            Instance *instance = (Instance *)object;
+            put_pointer(writer, at + offsetof(Instance, shape), instance->shape);
+            FIELD(writer, Instance, at, capacity) = instance->shape->count;
+            put_values(writer, at + offsetof(Instance, fields),
+                instance->fields, instance->shape->count);
+            break;
+        }
+        case BOUND_METHOD: {
+            BoundMethod *bound = (BoundMethod *)object;
+            put_value(
+                writer, at + offsetof(BoundMethod, receiver), bound->receiver
+            );
+            put_pointer(
+                writer, at + offsetof(BoundMethod, method), bound->method
+            );
+            break;
+        }
+    }
+}
+
+static void free_writer(Writer *writer) {
+    if (writer->data != NULL) {
+        FREE_ARRAY(char, writer->data, writer->capacity, MEM_IMAGE);
+    }
+    if (writer->placements != NULL) {
+        FREE_ARRAY(Placement, writer->placements, writer->placement_count,
+            MEM_IMAGE);
+    }
+    for (int i = 0; i < LIST_COUNT; i++) {
+        OffsetList *list = &writer->lists[i];
+        if (list->offsets != NULL) {
+            FREE_ARRAY(uint32_t, list->offsets, list->capacity, MEM_IMAGE);
+        }
+    }
+}
+
+bool write_image(const char *path) {
+#ifdef SHARED_STRINGS
+    // the strings are the process's, not on vm.objects
+    (void)path;
+    fprintf(stderr, "Images need strings of the VM's own.\n");
+    return false;
+#endif
+    Writer writer = {0};
+    reserve(&writer, sizeof(ImageHeader));
+
+    int count = 0;
+    for (ObjectRef ref = vm.objects; ref != NULL_REF;
+         ref = OBJECT_PTR(ref)->next) {
+        count++;
+    }
+    // the objects in chain order, then sorted for looking them up
+    Object **objects = ALLOCATE(Object *, count, MEM_IMAGE);
+    writer.placements = ALLOCATE(Placement, count, MEM_IMAGE);
+    writer.placement_count = count;
+    int i = 0;
+    for (ObjectRef ref = vm.objects; ref != NULL_REF;
+         ref = OBJECT_PTR(ref)->next, i++) {
+        objects[i] = OBJECT_PTR(ref);
+        writer.placements[i] = (Placement){
+            .object = objects[i],
+            .offset = (uint32_t)reserve(&writer, object_size(objects[i]))
+        };
+    }
+    uint64_t first = count == 0 ? 0 : writer.placements[0].offset;
+    uint64_t last = count == 0 ? 0 : writer.placements[count - 1].offset;
+    qsort(writer.placements, count, sizeof(Placement), compare_placements);
+    for (i = 0; i < count; i++) {
+        Object *next = i + 1 < count ? objects[i + 1] : NULL;
+        put_object(&writer, object_offset(&writer, objects[i]),
+            objects[i], next);
+    }
+    FREE_ARRAY(Object *, objects, count, MEM_IMAGE);
+
+    FIELD(&writer, ImageHeader, 0, strings) = vm.strings;
+    put_table(&writer, offsetof(ImageHeader, strings), &vm.strings);
+    FIELD(&writer, ImageHeader, 0, globals) = vm.globals;
+    put_table(&writer, offsetof(ImageHeader, globals), &vm.globals);
+
+    ImageHeader header = {
+        .layout = image_layout(),
+        .next_function_id = vm.next_function_id,
+        .base = IMAGE_BASE,
+        .cage_offset = IMAGE_CAGE_OFFSET,
+        .first = first,
+        .last = last
+    };
+    memcpy(header.magic, image_magic, sizeof(image_magic));
+    for (int list = 0; list < LIST_COUNT; list++) {
+        OffsetList *offsets = &writer.lists[list];
+        header.counts[list] = (uint32_t)offsets->count;
+        header.lists[list] = offsets->count == 0 ? 0 : append(&writer,
+            offsets->offsets, sizeof(uint32_t) * offsets->count);
+    }
+    header.size = writer.size;
+    header.strings = FIELD(&writer, ImageHeader, 0, strings);
+    header.globals = FIELD(&writer, ImageHeader, 0, globals);
+    memcpy(writer.data, &header, sizeof(header));
+
+    bool written = false;
+    if (writer.size > UINT32_MAX) {
+        fprintf(stderr, "The heap is too large for an image.\n");
+    } else {
+        FILE *file = fopen(path, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open \"%s\".\n", path);
+        } else {
+            written = fwrite(writer.data, 1, writer.size, file) == writer.size;
+            written = fclose(file) == 0 && written;
+            if (!written) {
+                fprintf(stderr, "Could not write \"%s\".\n", path);
+            }
+        }
+    }
+    free_writer(&writer);
+    return written;
+}
+
+// Loading
+
+static uint32_t *image_list(ImageHeader *header, ImageList list) {
+    return (uint32_t *)(image_start + header->lists[list]);
+}
+
+static char *map_image(int fd, ImageHeader *header, size_t *cage_offset) {
+#ifdef HEAP_CAGE
+    *cage_offset = cage_map(fd, header->size, IMAGE_CAGE_OFFSET);
+    return *cage_offset == 0 ? NULL : cage_base + *cage_offset;
+#else
+    *cage_offset = 0;
+    void *address = mmap((void *)(uintptr_t)header->base, header->size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    if (address == MAP_FAILED) {
+        // taken, the pointers are moved instead
+        address = mmap(NULL, header->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE, fd, 0);
+    }
+    return address == MAP_FAILED ? NULL : (char *)address;
+#endif
+}
+
+static void relocate(ImageHeader *header, size_t cage_offset) {
+    uint64_t delta = (uint64_t)(uintptr_t)image_start - header->base;
+    if (delta != 0) {
+        uint32_t *pointers = image_list(header, LIST_POINTERS);
+        for (uint32_t i = 0; i < header->counts[LIST_POINTERS]; i++) {
+            *(uint64_t *)(image_start + pointers[i]) += delta;
+        }
+    }
+    uint32_t ref_delta = (uint32_t)(cage_offset - header->cage_offset);
+    if (ref_delta != 0) {
+        uint32_t *refs = image_list(header, LIST_REFS);
+        for (uint32_t i = 0; i < header->counts[LIST_REFS]; i++) {
+            *(uint32_t *)(image_start + refs[i]) += ref_delta;
+        }
+    }
+}
+
+bool load_image(const char *path) {
+#ifdef SHARED_STRINGS
+    (void)path;
+    fprintf(stderr, "Images need strings of the VM's own.\n");
+    return false;
+#endif
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open \"%s\".\n", path);
+        return false;
+    }
+    ImageHeader header;
+    struct stat status;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || memcmp(header.magic, image_magic, sizeof(image_magic)) != 0
+        || header.layout != image_layout()
+        || fstat(fd, &status) != 0
+        || (uint64_t)status.st_size != header.size) {
+        fprintf(stderr, "\"%s\" is not an image for this build.\n", path);
+        close(fd);
+        return false;
+    }
+    size_t cage_offset;
+    char *start = map_image(fd, &header, &cage_offset);
+    close(fd);
+    if (start == NULL) {
+        fprintf(stderr, "Could not map \"%s\".\n", path);
+        return false;
+    }
+    image_start = start;
+    image_size = header.size;
+    track_memory(MEM_IMAGE, 0, image_size);
+    relocate(&header, cage_offset);
+
+    ImageHeader *image = (ImageHeader *)image_start;
+    uint32_t *natives = image_list(image, LIST_NATIVES);
+    for (uint32_t i = 0; i < image->counts[LIST_NATIVES]; i++) {
+        Native *native = (Native *)(image_start + natives[i]);
+        native->function = find_native(native->name->data);
+        if (native->function == NULL) {
+            fprintf(stderr, "No native '%s' for the image.\n",
+                native->name->data);
+            return false;
+        }
+    }
+    uint32_t *maps = image_list(image, LIST_MAPS);
+    for (uint32_t i = 0; i < image->counts[LIST_MAPS]; i++) {
+        value_table_rehash(&((Map *)(image_start + maps[i]))->table);
+    }
+
+    // the image has its own natives and their names
+    free_table(&vm.strings);
+    free_table(&vm.globals);
+    vm.strings = image->strings;
+    vm.globals = image->globals;
+    if (image->last != 0) {
+        Object *last = (Object *)(image_start + image->last);
+        last->next = vm.objects;
+        vm.objects = OBJECT_REF(image_start + image->first);
+    }
+    if (image->next_function_id > vm.next_function_id) {
+        vm.next_function_id = image->next_function_id;
+    }
+    for (ObjectRef ref = vm.objects; ref != NULL_REF;
+         ref = OBJECT_PTR(ref)->next) {
+        Object *object = OBJECT_PTR(ref);
+        if (object->type == FUNCTION) {
+            register_function((Function *)object);
+        }
+    }
+    return true;
+}
+
+void free_image() {
+    if (image_start == NULL) {
+        return;
+    }
+#ifndef HEAP_CAGE
+    // a cage unmaps it with everything else
+    munmap(image_start, image_size);
+#endif
+    track_memory(MEM_IMAGE, image_size, 0);
+    image_start = NULL;
+    image_size = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include "common.h"
+
+// Heap images: the objects, interned strings and globals of a VM that has
+// run a prelude, written out so that another run can map them in instead
+// of running the prelude again.
+//
+// An image is laid out for a fixed address and records every pointer it
+// holds. Loading maps the file there when that address is free, which
+// leaves nothing to fix up: pages are only read in as they are used.
+// Otherwise the pointers are moved in one pass. With HEAP_CAGE the image
+// goes into the cage and its 32-bit references are placed the same way,
+// but the cage's own address differs between runs, so pointers are always
+// moved.
+//
+// The loaded objects stay in the mapping. Their arrays move to the heap
+// when they grow (see reallocate()) and they are never freed one by one.
+// Images only load into the build that wrote them, and not at all with
+// SHARED_STRINGS.
+
+// Writes the state of the VM, which must not be running, to `path`.
+bool write_image(const char *path);
+// Maps the image at `path` into a VM that has just been initialized.
+bool load_image(const char *path);
+// unmaps the image, after its objects have been released
+void free_image();
+
+extern char *image_start;
+extern size_t image_size;
+
+static inline bool in_image(const void *pointer) {
+    return (uintptr_t)pointer - (uintptr_t)image_start < image_size;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include "debug.h"
+#include "instrument.h"
+#include "memory.h"
+#include "object.h"
+#include "perf.h"
+#include "vm.h"
+
+static uint64_t opcode_counts[UINT8_MAX + 1];
+// what instrument_on_signal() switches on
+static int signal_flags;
+
+static void trace(Chunk *chunk, int offset) {
+    // keep the program output in order with the trace
+    flush_output(&vm.output);
+    printf("          ");
+    for (Value *slot = vm.stack; slot < vm.top; slot++) {
+        print_value(*slot);
+        flush_output(&vm.output);
+        printf(", ");
+    }
+    printf("\n");
+    disassemble_instruction(chunk, offset);
+}
+
+static void cover(Chunk *chunk, int offset) {
+    if UNLIKELY(chunk->coverage == NULL) {
+        chunk->coverage = ALLOCATE(uint8_t, chunk->count, MEM_CODE);
+        memset(chunk->coverage, 0, chunk->count);
+    }
+    chunk->coverage[offset] = 1;
+}
+
+void instrument(CallFrame *frame) {
+    Chunk *chunk = &frame->function->chunk;
+    int offset = (int)(frame->ip - chunk->code);
+    uint8_t opcode = chunk->code[offset];
+    int flags = vm.instrumentation;
+    if (flags & INSTRUMENT_TRACE) trace(chunk, offset);
+    if (flags & INSTRUMENT_COUNTS) opcode_counts[opcode]++;
+    if (flags & INSTRUMENT_COVERAGE) cover(chunk, offset);
+    // last, so the hooks above are not charged to the handler
+    if (flags & INSTRUMENT_PERF) perf_sample(opcode);
+}
+
+// Only counts: the interpreter may be halfway through linking an object or
+// rewriting an instruction, so the switch waits for a safe point in run().
+static void handle_signal(UNUSED int signal) {
+    vm.instrument_signals++;
+}
+
+void handle_instrument_signals() {
+    // the flags the last signal turned on, taken off by the next one; those
+    // that were on already, say from the command line, stay as they are
+    static int added = 0;
+    sig_atomic_t signals = vm.instrument_signals;
+    // an even number of toggles cancels out
+    if ((signals - vm.instrument_signals_handled) & 1) {
+        if (added != 0) {
+            set_instrumentation(vm.instrumentation & ~added);
+            added = 0;
+        } else {
+            added = signal_flags & ~vm.instrumentation;
+            set_instrumentation(vm.instrumentation | added);
+        }
+    }
+    vm.instrument_signals_handled = signals;
+}
+
+bool instrument_on_signal(int signal, int flags) {
+    signal_flags = flags;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signal, &action, NULL) == 0;
+}
+
+static void print_counts(FILE *file) {
+    fprintf(file, "%-24s %12s\n", "opcode", "count");
+    for (int opcode = 0; opcode <= UINT8_MAX; opcode++) {
+        if (opcode_counts[opcode] == 0) continue;
+        fprintf(file, "%-24s %12llu\n", opcode_name(opcode),
+            (unsigned long long)opcode_counts[opcode]);
+    }
+}
+
+// instructions that ran out of all of them, then the lines with
+// instructions that never did
+static void print_coverage(FILE *file, Chunk *chunk, const char *name) {
+    int instructions = 0;
+    int reached = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk->code[offset])) {
+        instructions++;
+        if (chunk->coverage != NULL && chunk->coverage[offset]) reached++;
+    }
+    fprintf(file, "%-16s %6d/%-6d", name, reached, instructions);
+
+    int last_line = -1;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk->code[offset])) {
+        bool ran = chunk->coverage != NULL && chunk->coverage[offset];
+        if (ran || chunk->lines[offset] == last_line) continue;
+        if (last_line == -1) fprintf(file, " not run:");
+        last_line = chunk->lines[offset];
+        fprintf(file, " %d", last_line);
+    }
+    fprintf(file, "\n");
+}
+
+void print_instrumentation(FILE *file) {
+    bool counted = false;
+    for (int opcode = 0; opcode <= UINT8_MAX; opcode++) {
+        counted |= opcode_counts[opcode] != 0;
+    }
+    if (counted) print_counts(file);
+
+    bool covered = false;
+    for (ObjectRef ref = vm.objects; ref != NULL_REF;
+         ref = OBJECT_PTR(ref)->next) {
+        Object *object = OBJECT_PTR(ref);
+        covered |= object->type == FUNCTION
+            && ((Function *)object)->chunk.coverage != NULL;
+    }
+    if (!covered) return;
+    if (counted) fprintf(file, "\n");
+    fprintf(file, "%-16s %13s\n", "function", "instructions");
+    for (ObjectRef ref = vm.objects; ref != NULL_REF;
+         ref = OBJECT_PTR(ref)->next) {
+        Object *object = OBJECT_PTR(ref);
+        if (object->type != FUNCTION) continue;
+        Function *function = (Function *)object;
+        const char *name = function->name == NULL
+            ? "script" : string_cstring(function->name);
+        print_coverage(file, &function->chunk, name);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdio.h>
+#include "common.h"
+#include "vm.h"
+
+// What the instrumented dispatch table does before every instruction. It
+// is switched in and out with set_instrumentation() (vm.h); while no flag
+// is set run() dispatches straight to the handlers and none of this costs
+// anything.
+typedef enum {
+    // executions per opcode
+    INSTRUMENT_COUNTS = 1 << 0,
+    // which instructions ran, per function
+    INSTRUMENT_COVERAGE = 1 << 1,
+    // the stack and the next instruction, printed to stdout
+    INSTRUMENT_TRACE = 1 << 2,
+    // hardware counters per opcode, see perf.h
+    INSTRUMENT_PERF = 1 << 3
+} Instrumentation;
+
+// Called by the instrumented dispatch with the interpreter state spilled
+// and frame->ip at the instruction about to run.
+void instrument(CallFrame *frame);
+
+// Toggles `flags` every time `signal` arrives, so a running process can be
+// profiled; flags that were on before the first signal stay on. The
+// handler only counts the signal, run() switches at the next call, return
+// or loop back-edge.
+// Returns false if the handler could not be installed.
+bool instrument_on_signal(int signal, int flags);
+// Applies the signals counted since the last call, see SAFE_POINT in vm.c.
+void handle_instrument_signals();
+
+// Opcode counts and coverage collected so far, if there are any.
+void print_instrumentation(FILE *file);
+
+#endif
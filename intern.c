@@ -0,0 +1,247 @@
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+
+#ifdef SHARED_STRINGS
+
+#define INITIAL_CAPACITY 1024
+// slots copied at a time when growing
+#define CHUNK 256
+// a slot whose string is in the next array
+#define MOVED ((String *)1)
+
+typedef struct StringArray StringArray;
+struct StringArray {
+    // a power of two
+    size_t capacity;
+    // slots taken, the array grows past 3/4 of the capacity
+    atomic_size_t count;
+    // the bigger array being copied to, set once
+    _Atomic(StringArray *) next;
+    // chunks handed out for copying, and those done
+    atomic_size_t claimed;
+    atomic_size_t copied;
+    // the one this was copied from, kept for readers until exit
+    StringArray *older;
+    _Atomic(String *) slots[];
+};
+
+static _Atomic(StringArray *) current;
+
+static StringArray *new_array(size_t capacity, StringArray *older) {
+    StringArray *array = (StringArray *)calloc(
+        1, sizeof(StringArray) + sizeof(_Atomic(String *)) * capacity
+    );
+    if (array == NULL) exit(1);
+    array->capacity = capacity;
+    array->older = older;
+    return array;
+}
+
+// Only at exit, with no other thread left to look.
+static void free_shared_strings() {
+    StringArray *array = atomic_load(&current);
+    for (StringArray *next; (next = atomic_load(&array->next)) != NULL;) {
+        array = next;
+    }
+    while (array != NULL) {
+        for (size_t i = 0; i < array->capacity; i++) {
+            String *string = atomic_load(&array->slots[i]);
+            if (string != NULL && string != MOVED) {
+                free(string);
+            }
+        }
+        StringArray *older = array->older;
+        free(array);
+        array = older;
+    }
+}
+
+static StringArray *first_array() {
+    StringArray *array = atomic_load_explicit(&current, memory_order_acquire);
+    if UNLIKELY(array == NULL) {
+        StringArray *fresh = new_array(INITIAL_CAPACITY, NULL);
+        if (atomic_compare_exchange_strong(&current, &array, fresh)) {
+            atexit(free_shared_strings);
+            array = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+    return array;
+}
+
+static String *make_shared(const char *data, int length, uint32_t hash) {
+    String *string = (String *)malloc(sizeof(String) + length + 1);
+    if (string == NULL) exit(1);
+    string->object.type = STRING;
+    string->object.flags = STRING_HASHED | STRING_INTERNED;
+    string->object.next = NULL_REF;
+    string->length = length;
+    string->hash = hash;
+    memcpy(string->data, data, length);
+    string->data[length] = '\0';
+    return string;
+}
+
+static inline bool matches(
+    String *string, const char *data, int length, uint32_t hash
+) {
+    return string->hash == hash && string->length == length
+        && memcmp(string->data, data, length) == 0;
+}
+
+static inline size_t chunk_count(StringArray *array) {
+    return (array->capacity + CHUNK - 1) / CHUNK;
+}
+
+// whether everything in `array` is in its next one
+static inline bool copied(StringArray *array) {
+    return atomic_load_explicit(&array->copied, memory_order_acquire)
+        == chunk_count(array);
+}
+
+// Puts a string from the array before into `array`. Nothing else inserts
+// until the copy is done and the strings are all different, so the first
+// empty slot will do.
+static void place(StringArray *array, String *string) {
+    size_t mask = array->capacity - 1;
+    for (size_t index = string->hash & mask;; index = (index + 1) & mask) {
+        String *empty = NULL;
+        if (atomic_compare_exchange_strong(&array->slots[index], &empty, string)) {
+            atomic_fetch_add(&array->count, 1);
+            return;
+        }
+    }
+}
+
+// Every string is placed in `next` before its slot is sealed, so a reader
+// that finds MOVED can look there.
+static void copy_chunk(StringArray *array, StringArray *next, size_t chunk) {
+    size_t end = (chunk + 1) * CHUNK;
+    if (end > array->capacity) end = array->capacity;
+    for (size_t i = chunk * CHUNK; i < end; i++) {
+        String *string = NULL;
+        if (atomic_compare_exchange_strong(&array->slots[i], &string, MOVED)) {
+            continue;
+        }
+        // taken after all; strings never leave a slot but through here
+        place(next, string);
+        atomic_store(&array->slots[i], MOVED);
+    }
+}
+
+// Copies chunks nobody has claimed yet, then waits for the rest. Returns
+// the array to insert into from now on.
+static StringArray *finish_copy(StringArray *array, StringArray *next) {
+    size_t chunks = chunk_count(array);
+    for (;;) {
+        size_t chunk = atomic_fetch_add(&array->claimed, 1);
+        if (chunk >= chunks) break;
+        copy_chunk(array, next, chunk);
+        atomic_fetch_add(&array->copied, 1);
+    }
+    while (!copied(array)) {
+        sched_yield();
+    }
+    // whoever gets here first moves everyone on
+    atomic_compare_exchange_strong(&current, &array, next);
+    return next;
+}
+
+static void grow(StringArray *array) {
+    if (atomic_load(&array->next) != NULL) {
+        return;
+    }
+    StringArray *bigger = new_array(2 * array->capacity, array);
+    StringArray *none = NULL;
+    if (!atomic_compare_exchange_strong(&array->next, &none, bigger)) {
+        free(bigger);
+    }
+}
+
+String *shared_find(const char *data, int length, uint32_t hash) {
+    StringArray *array = first_array();
+    while (array != NULL) {
+        StringArray *next = atomic_load_explicit(
+            &array->next, memory_order_acquire
+        );
+        if (next != NULL && copied(array)) {
+            array = next;
+            continue;
+        }
+        // A MOVED slot may have held the string, and it is in `next` then.
+        // Slots further on that are not sealed yet still count here.
+        bool sealed = false;
+        size_t mask = array->capacity - 1;
+        size_t index = hash & mask;
+        size_t probes = 0;
+        for (; probes < array->capacity; probes++) {
+            String *string = atomic_load_explicit(
+                &array->slots[index], memory_order_acquire
+            );
+            if (string == NULL) {
+                break;
+            }
+            if (string == MOVED) {
+                sealed = true;
+            } else if (matches(string, data, length, hash)) {
+                return string;
+            }
+            index = (index + 1) & mask;
+        }
+        if (!sealed && probes < array->capacity) {
+            return NULL;
+        }
+        array = atomic_load_explicit(&array->next, memory_order_acquire);
+    }
+    return NULL;
+}
+
+String *shared_intern(const char *data, int length, uint32_t hash) {
+    String *fresh = NULL;
+    StringArray *array = first_array();
+    for (;;) {
+        StringArray *next;
+        while ((next = atomic_load(&array->next)) != NULL) {
+            array = finish_copy(array, next);
+        }
+        size_t mask = array->capacity - 1;
+        size_t index = hash & mask;
+        size_t probes = 0;
+        for (; probes < array->capacity; probes++) {
+            String *string = atomic_load_explicit(
+                &array->slots[index], memory_order_acquire
+            );
+            if (string == NULL) {
+                if (atomic_load_explicit(&array->count, memory_order_relaxed)
+                    >= array->capacity / 4 * 3) {
+                    break;
+                }
+                if (fresh == NULL) {
+                    fresh = make_shared(data, length, hash);
+                }
+                if (atomic_compare_exchange_strong(
+                        &array->slots[index], &string, fresh)) {
+                    atomic_fetch_add(&array->count, 1);
+                    return fresh;
+                }
+                // someone else got there, look at what they put
+            }
+            if (string == MOVED) {
+                break;
+            }
+            if (matches(string, data, length, hash)) {
+                free(fresh);
+                return string;
+            }
+            index = (index + 1) & mask;
+        }
+        // full, or being copied to a bigger array
+        grow(array);
+    }
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include "common.h"
+#include "object.h"
+
+// With SHARED_STRINGS, interned strings live in one table for the whole
+// process instead of in vm.strings, so every VM in it shares them and two
+// equal interned strings are still the same pointer.
+//
+// The table is open addressing over an array of atomic pointers. Lookups
+// take no locks and never wait. Inserts claim an empty slot with a
+// compare-and-swap. When the array fills up, a bigger one is hung off it
+// and every thread that runs into it helps copy chunks of slots over, each
+// slot sealed as it goes so no insert can land behind the copy. Inserts go
+// to the new array once the copy is done; until then they wait for the
+// chunks other threads are copying. Old arrays may still be read by
+// someone, so they are kept until exit.
+//
+// The strings themselves are made once, never written again and freed at
+// exit: they are not on any VM's object list.
+
+#ifdef SHARED_STRINGS
+
+#ifdef HEAP_CAGE
+#error "SHARED_STRINGS needs 64-bit references, the cage is per VM"
+#endif
+
+// the interned string with these contents, made if there is none
+String *shared_intern(const char *data, int length, uint32_t hash);
+// the interned string with these contents, NULL if there is none
+String *shared_find(const char *data, int length, uint32_t hash);
+
+#endif
+
+#endif
@@ -0,0 +1,193 @@
+#include <string.h>
+#include "list.h"
+#include "memory.h"
+
+// The numeric operations first collect the types in the list in one pass,
+// then take a fast path for that mix. Lists of ints only are summed and
+// compared as integers, which the compiler vectorizes. Lists of numbers go
+// through LANES doubles at a time with GCC's vector extensions. A Value
+// keeps its payload in its second word, so each lane is filled from its
+// own element. The gain comes from the independent adds and compares the
+// lanes keep in flight.
+
+#define LANES 4
+typedef double Lanes __attribute__((vector_size(LANES * sizeof(double))));
+typedef int64_t LaneMask __attribute__((vector_size(LANES * sizeof(int64_t))));
+
+#define TYPE_BIT(type) (1u << (type))
+#define INTS TYPE_BIT(VAL_INT)
+#define NUMBERS (TYPE_BIT(VAL_INT) | TYPE_BIT(VAL_NUMBER))
+
+// one bit for every ValueType in the list
+static unsigned element_types(List *list) {
+    unsigned types = 0;
+    for (int i = 0; i < list->count; i++) {
+        types |= TYPE_BIT(list->values[i].type);
+    }
+    return types;
+}
+
+// a macro, returning vectors wider than SSE from a function warns
+#define LOAD_LANES(values) \
+    ((Lanes){ \
+        AS_NUMBER((values)[0]), AS_NUMBER((values)[1]), \
+        AS_NUMBER((values)[2]), AS_NUMBER((values)[3]) \
+    })
+
+// kept out of run(), where inlining it costs the hot handlers registers
+__attribute__((noinline))
+List *list_from(Value *values, int count) {
+    List *list = new_list(count);
+    if (count > 0) {
+        memcpy(list->values, values, sizeof(Value) * count);
+    }
+    return list;
+}
+
+void list_append(List *list, Value value) {
+    if UNLIKELY(list->capacity < list->count + 1) {
+        int old_capacity = list->capacity;
+        list->capacity = old_capacity < 8 ? 8 : 2 * old_capacity;
+        list->values = GROW_ARRAY(
+            Value, list->values, old_capacity, list->capacity, MEM_LIST
+        );
+    }
+    list->values[list->count++] = value;
+}
+
+void list_fill(List *list, Value value) {
+    for (int i = 0; i < list->count; i++) {
+        list->values[i] = value;
+    }
+}
+
+bool list_contains(List *list, Value value) {
+    for (int i = 0; i < list->count; i++) {
+        if (is_equal(list->values[i], value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool list_sum(List *list, Value *result) {
+    Value *values = list->values;
+    int count = list->count;
+    unsigned types = element_types(list);
+    if ((types & ~INTS) == 0) {
+        // exact, INT_MAX elements of at most 2^31 stay below 2^62
+        int64_t sum = 0;
+        for (int i = 0; i < count; i++) {
+            sum += values[i].as.integer;
+        }
+        *result = number_value((double)sum);
+        return true;
+    }
+    if ((types & ~NUMBERS) != 0) {
+        return false;
+    }
+    // the lanes add in a different order than a loop would, which can
+    // change the last bits of a sum of fractions
+    Lanes sums = {0};
+    int i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        sums += LOAD_LANES(&values[i]);
+    }
+    double sum = 0;
+    for (int lane = 0; lane < LANES; lane++) {
+        sum += sums[lane];
+    }
+    for (; i < count; i++) {
+        sum += AS_NUMBER(values[i]);
+    }
+    *result = NUMBER_VAL(sum);
+    return true;
+}
+
+// The smallest element, or the largest with `max`. An element only takes
+// over when it compares less (or greater) than the one found so far, so a
+// NaN is passed over unless it comes first.
+static inline bool extreme(List *list, bool max, Value *result) {
+    Value *values = list->values;
+    int count = list->count;
+    unsigned types = element_types(list);
+    if ((types & ~NUMBERS) != 0) {
+        return false;
+    }
+    if (count == 0) {
+        *result = NIL_VAL;
+        return true;
+    }
+    if ((types & ~INTS) == 0) {
+        int32_t best = AS_INT(values[0]);
+        for (int i = 1; i < count; i++) {
+            int32_t x = AS_INT(values[i]);
+            best = (max ? x > best : x < best) ? x : best;
+        }
+        *result = INT_VAL(best);
+        return true;
+    }
+    Lanes bests = (Lanes){0} + AS_NUMBER(values[0]);
+    int i = 1;
+    for (; i + LANES <= count; i += LANES) {
+        Lanes x = LOAD_LANES(&values[i]);
+        LaneMask take = max ? x > bests : x < bests;
+        bests = (Lanes)((take & (LaneMask)x) | (~take & (LaneMask)bests));
+    }
+    double best = bests[0];
+    for (int lane = 1; lane < LANES; lane++) {
+        if (max ? bests[lane] > best : bests[lane] < best) best = bests[lane];
+    }
+    for (; i < count; i++) {
+        double x = AS_NUMBER(values[i]);
+        if (max ? x > best : x < best) best = x;
+    }
+    *result = number_value(best);
+    return true;
+}
+
+bool list_min(List *list, Value *result) {
+    return extreme(list, false, result);
+}
+
+bool list_max(List *list, Value *result) {
+    return extreme(list, true, result);
+}
+
+// x * factor for two ints, an int unless the product needs a double: it
+// does not fit in 32 bits or is -0
+static inline Value multiply_ints(int64_t x, int64_t factor) {
+    int64_t product = x * factor;
+    if (product == (int32_t)product
+        && (product != 0 || (x >= 0 && factor >= 0))) {
+        return INT_VAL(product);
+    }
+    return NUMBER_VAL((double)x * (double)factor);
+}
+
+List *list_scale(List *list, Value factor) {
+    unsigned types = element_types(list);
+    if (!IS_NUMBER(factor) || (types & ~NUMBERS) != 0) {
+        return NULL;
+    }
+    int count = list->count;
+    List *result = new_list(count);
+    Value *values = list->values;
+    Value *scaled = result->values;
+    if ((types & ~INTS) == 0 && IS_INT(factor)) {
+        int64_t by = AS_INT(factor);
+        for (int i = 0; i < count; i++) {
+            scaled[i] = multiply_ints(values[i].as.integer, by);
+        }
+        return result;
+    }
+    double by = AS_NUMBER(factor);
+    for (int i = 0; i < count; i++) {
+        if (IS_INT(values[i]) && IS_INT(factor)) {
+            scaled[i] = multiply_ints(values[i].as.integer, AS_INT(factor));
+        } else {
+            scaled[i] = NUMBER_VAL(AS_NUMBER(values[i]) * by);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,28 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Operations on List objects. The numeric ones have fast paths for lists
+// of ints only and of numbers only, see list.c; anything else in the list
+// makes them return false.
+
+// A new list of the `count` values at `values`.
+List *list_from(Value *values, int count);
+// Adds `value` at the end, doubling the storage when it is full.
+void list_append(List *list, Value value);
+void list_fill(List *list, Value value);
+// whether an element is equal to `value`
+bool list_contains(List *list, Value value);
+
+bool list_sum(List *list, Value *result);
+// nil for an empty list
+bool list_min(List *list, Value *result);
+bool list_max(List *list, Value *result);
+// A new list of every element times `factor`, each the same as `x * factor`
+// would give. NULL if an element or the factor is not a number.
+List *list_scale(List *list, Value factor);
+
+#endif
@@ -1,3 +1,4 @@
+#include "signal.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
@@ -5,6 +6,12 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "flight.h"
+#include "image.h"
+#include "instrument.h"
+#include "memory.h"
+#include "perf.h"
+#include "stack.h"
 #include "vm.h"
 
 static void repl() {
@@ -18,6 +25,9 @@ static void repl() {
             break;
         }
         interpret(line);
+        // the next line goes where this one was
+        release_sources();
+        flush_output(&vm.output);
     }
 }
 
@@ -53,27 +63,128 @@ static char *read_file(const char *path) {
     return buffer;
 }
 
-static void run_file(const char *path) {
-    char *source = read_file(path);
+// The file run or decoded. Its names and literals are borrowed (see
+// borrow_string()), so it is freed after the VM.
+static char *source = NULL;
+
+static int run_file(const char *path) {
+    source = read_file(path);
     InterpretResult result = interpret(source);
-    free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+static int decode_file(const char *dump, const char *path) {
+    source = read_file(path);
+    bool decoded = decode_flight(dump, source);
+    return decoded ? 0 : 65;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [--perf-counters] [--count-opcodes] "
+        "[--coverage] [--trace] [--mem-stats] [--hot-loops] "
+        "[--stack-limit slots] [--flight-recorder dump] "
+        "[--flight-samples calls] [--image image] [path]\n"
+        "       clox --decode-flight dump path\n"
+        "       clox --snapshot image prelude\n");
+    exit(64);
 }
 
 int main(int argc, char *argv[]) {
     init_vm();
 
-    if (argc == 1) {
+    const char *path = NULL;
+    const char *decode = NULL;
+    const char *snapshot = NULL;
+    const char *image = NULL;
+    bool mem_stats = false;
+    int instrumentation = vm.instrumentation;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf-counters") == 0) {
+            instrumentation |= INSTRUMENT_PERF;
+        } else if (strcmp(argv[i], "--count-opcodes") == 0) {
+            instrumentation |= INSTRUMENT_COUNTS;
+        } else if (strcmp(argv[i], "--coverage") == 0) {
+            instrumentation |= INSTRUMENT_COVERAGE;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            instrumentation |= INSTRUMENT_TRACE;
+        } else if (strcmp(argv[i], "--hot-loops") == 0) {
+            vm.hot_loops = true;
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            mem_stats = true;
+        } else if (strcmp(argv[i], "--stack-limit") == 0 && i + 1 < argc) {
+            char *end;
+            long long slots = strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || slots <= 0 || !set_stack_limit(slots)) {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--flight-recorder") == 0 && i + 1 < argc) {
+            set_flight_dump(argv[++i]);
+        } else if (strcmp(argv[i], "--flight-samples") == 0 && i + 1 < argc) {
+            char *end;
+            long long calls = strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || calls <= 0 || calls > UINT32_MAX) {
+                usage();
+            }
+            flight_sample_stack((uint32_t)calls);
+        } else if (strcmp(argv[i], "--decode-flight") == 0 && i + 1 < argc) {
+            decode = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (decode != NULL) {
+        if (path == NULL) usage();
+        int status = decode_file(decode, path);
+        free_vm();
+        free(source);
+        return status;
+    }
+    if (snapshot != NULL && path == NULL) usage();
+    if (image != NULL && !load_image(image)) {
+        free_vm();
+        return 74;
+    }
+
+    bool perf_counters = instrumentation & INSTRUMENT_PERF;
+    if (perf_counters) {
+        init_perf_counters();
+    }
+    set_instrumentation(instrumentation);
+    // kill -USR1 toggles opcode counts and coverage in a running process
+    instrument_on_signal(SIGUSR1, INSTRUMENT_COUNTS | INSTRUMENT_COVERAGE);
+
+    int status = 0;
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        status = run_file(path);
+        // only a prelude that ran to the end is worth starting from
+        if (snapshot != NULL && status == 0 && !write_image(snapshot)) {
+            status = 74;
+        }
+    }
+
+    flush_output(&vm.output);
+    if (perf_counters) {
+        print_perf_counters(stderr);
+        free_perf_counters();
+    }
+    print_instrumentation(stderr);
+    if (mem_stats) {
+        print_memory_stats(stderr);
     }
 
     free_vm();
-    return 0;
+    free(source);
+    return status;
 }
@@ -0,0 +1,30 @@
+#include "map.h"
+#include "table.h"
+
+// kept out of run(), where inlining it costs the hot handlers registers
+__attribute__((noinline))
+Map *map_from(Value *pairs, int count) {
+    Map *map = new_map();
+    for (int i = 0; i < count; i++) {
+        map_set(map, pairs[2 * i], pairs[2 * i + 1]);
+    }
+    return map;
+}
+
+int map_index(Map *map, Value key) {
+    return value_table_index(&map->table, key);
+}
+
+void map_set(Map *map, Value key, Value value) {
+    if (value_table_set(&map->table, key, value)) {
+        map->count++;
+    }
+}
+
+bool map_delete(Map *map, Value key) {
+    if (value_table_delete(&map->table, key)) {
+        map->count--;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,25 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Operations on Map objects, which keep their entries in a ValueTable and
+// so take any value as a key, see table.h.
+
+// A new map of the `count` key/value pairs at `pairs`, later keys winning.
+Map *map_from(Value *pairs, int count);
+// The slot of the entry for `key` in map->table.values, -1 if there is none.
+// An index rather than an out-parameter keeps the handlers from taking the
+// address of a local, which would stop their tail calls.
+int map_index(Map *map, Value key);
+void map_set(Map *map, Value key, Value value);
+// Returns false if there was no entry.
+bool map_delete(Map *map, Value key);
+
+static inline bool map_contains(Map *map, Value key) {
+    return map_index(map, key) >= 0;
+}
+
+#endif
@@ -1,10 +1,78 @@
 #include <stdlib.h>
+#include <string.h>
+#include "image.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 
-void *reallocate(void *pointer, UNUSED size_t old_size, size_t new_size) {
+static MemoryStats stats;
+
+static const char *category_names[MEM_CATEGORY_COUNT] = {
+    [MEM_CODE] = "code",
+    [MEM_LINES] = "lines",
+    [MEM_CONSTANTS] = "constants",
+    [MEM_LOOPS] = "loops",
+    [MEM_TABLE] = "tables",
+    [MEM_STRING] = "strings",
+    [MEM_FUNCTION] = "functions",
+    [MEM_STACK] = "stack",
+    [MEM_LIST] = "lists",
+    [MEM_CLASS] = "classes",
+    [MEM_INSTANCE] = "instances",
+    [MEM_IMAGE] = "image"
+};
+
+static int size_class(size_t size) {
+    int bucket = size <= 1 ? (int)size : 64 - __builtin_clzll(size - 1) + 1;
+    return bucket < SIZE_CLASS_COUNT ? bucket : SIZE_CLASS_COUNT - 1;
+}
+
+static void account(
+    MemoryCounters *counters, size_t old_size, size_t new_size
+) {
+    counters->live_bytes += new_size - old_size;
+    if (counters->live_bytes > counters->peak_bytes) {
+        counters->peak_bytes = counters->live_bytes;
+    }
+    if (new_size == 0) {
+        counters->frees++;
+        return;
+    }
+    if (old_size == 0) {
+        counters->allocations++;
+    } else {
+        counters->reallocations++;
+    }
+    counters->size_classes[size_class(new_size)]++;
+}
+
+void track_memory(MemoryCategory category, size_t old_size, size_t new_size) {
+    account(&stats.total, old_size, new_size);
+    account(&stats.categories[category], old_size, new_size);
+}
+
+// Memory in a loaded image belongs to the mapping: it is never freed
+// and moves out to the heap when it grows.
+static void *reallocate_from_image(
+    void *pointer, size_t old_size, size_t new_size, MemoryCategory category
+) {
+    if (new_size == 0) {
+        return NULL;
+    }
+    void *result = reallocate(NULL, 0, new_size, category);
+    memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+    return result;
+}
+
+void *reallocate(
+    void *pointer, size_t old_size, size_t new_size, MemoryCategory category
+) {
+    if UNLIKELY(in_image(pointer)) {
+        return reallocate_from_image(pointer, old_size, new_size, category);
+    }
+    track_memory(category, old_size, new_size);
+
     if (new_size == 0) {
         free(pointer);
         return NULL;
@@ -15,21 +83,137 @@ void *reallocate(void *pointer, UNUSED size_t old_size, size_t new_size) {
     return result;
 }
 
+void *allocate_object_memory(size_t size, MemoryCategory category) {
+#ifdef HEAP_CAGE
+    track_memory(category, 0, size);
+    return cage_allocate(size);
+#else
+    return reallocate(NULL, 0, size, category);
+#endif
+}
+
+void free_object_memory(void *object, size_t size, MemoryCategory category) {
+#ifdef HEAP_CAGE
+    // the cage itself goes away in free_cage(), images with it
+    if (!in_image(object)) {
+        track_memory(category, size, 0);
+    }
+#else
+    reallocate(object, size, 0, category);
+#endif
+}
+
 void free_object(Object *object) {
     switch (object->type) {
         case STRING: {
             String *string = (String *)object;
-            reallocate(string, sizeof(String) + string->length + 1, 0);
+            size_t size = sizeof(String) + string->length + 1;
+            if (object->flags & STRING_BORROWED) {
+                size = sizeof(String) + sizeof(const char *);
+            }
+            if (object->flags & STRING_RELEASED) {
+                FREE_ARRAY(char, (char *)string_chars(string),
+                    string->length + 1, MEM_STRING);
+            }
+            free_object_memory(string, size, MEM_STRING);
             break;
         }
+        case FUNCTION: {
+            Function *function = (Function *)object;
+            free_chunk(&function->chunk);
+            free_object_memory(function, sizeof(Function), MEM_FUNCTION);
+            break;
+        }
+        case NATIVE:
+            free_object_memory(object, sizeof(Native), MEM_FUNCTION);
+            break;
+        case LIST: {
+            List *list = (List *)object;
+            if (list->values != NULL) {
+                FREE_ARRAY(Value, list->values, list->capacity, MEM_LIST);
+            }
+            free_object_memory(list, sizeof(List), MEM_LIST);
+            break;
+        }
+        case MAP: {
+            Map *map = (Map *)object;
+            free_value_table(&map->table);
+            free_object_memory(map, sizeof(Map), MEM_TABLE);
+            break;
+        }
+        case CLASS: {
+            Class *klass = (Class *)object;
+            free_table(&klass->methods);
+            free_object_memory(klass, sizeof(Class), MEM_CLASS);
+            break;
+        }
+        case SHAPE: {
+            Shape *shape = (Shape *)object;
+            free_table(&shape->transitions);
+            free_object_memory(shape, sizeof(Shape), MEM_CLASS);
+            break;
+        }
+        case INSTANCE: {
+            Instance *instance = (Instance *)object;
+            if (instance->fields != NULL) {
+                FREE_ARRAY(
+                    Value, instance->fields, instance->capacity, MEM_INSTANCE
+                );
+            }
+            free_object_memory(instance, sizeof(Instance), MEM_INSTANCE);
+            break;
+        }
+        case BOUND_METHOD:
+            free_object_memory(object, sizeof(BoundMethod), MEM_CLASS);
+            break;
     }
 }
 
 void free_objects() {
-    Object *object = vm.objects;
-    while (object) {
-        Object *next = object->next;
-        free_object(object);
+    ObjectRef object = vm.objects;
+    while (object != NULL_REF) {
+        ObjectRef next = OBJECT_PTR(object)->next;
+        free_object(OBJECT_PTR(object));
         object = next;
     }
+    vm.objects = NULL_REF;
+}
+
+const MemoryStats *memory_stats() {
+    return &stats;
+}
+
+static void print_counters(
+    FILE *file, const char *name, MemoryCounters *counters
+) {
+    fprintf(file, "%-10s %12zu %12zu %10zu %10zu %10zu\n", name,
+        counters->live_bytes, counters->peak_bytes, counters->allocations,
+        counters->reallocations, counters->frees);
+}
+
+void print_memory_stats(FILE *file) {
+    fprintf(file, "%-10s %12s %12s %10s %10s %10s\n", "category",
+        "live", "peak", "allocs", "reallocs", "frees");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+        print_counters(file, category_names[i], &stats.categories[i]);
+    }
+    print_counters(file, "total", &stats.total);
+
+    fprintf(file, "\n%-10s", "size");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+        fprintf(file, " %10s", category_names[i]);
+    }
+    fprintf(file, "\n");
+    for (int bucket = 0; bucket < SIZE_CLASS_COUNT; bucket++) {
+        if (stats.total.size_classes[bucket] == 0) continue;
+        if (bucket == SIZE_CLASS_COUNT - 1) {
+            fprintf(file, ">%-9zu", (size_t)1 << (bucket - 2));
+        } else {
+            fprintf(file, "<=%-8zu", bucket == 0 ? 0 : (size_t)1 << (bucket - 1));
+        }
+        for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+            fprintf(file, " %10zu", stats.categories[i].size_classes[bucket]);
+        }
+        fprintf(file, "\n");
+    }
 }
@@ -1,21 +1,68 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdio.h>
 #include "common.h"
 #include "object.h"
 
-#define GROW_ARRAY(type, pointer, old_count, new_count) \
+#define GROW_ARRAY(type, pointer, old_count, new_count, category) \
     (type *)reallocate(pointer, sizeof(type) * (old_count), \
-        sizeof(type) * (new_count))
+        sizeof(type) * (new_count), category)
 
-#define FREE_ARRAY(type, pointer, old_count) \
-    reallocate(pointer, sizeof(type) * old_count, 0)
+#define FREE_ARRAY(type, pointer, old_count, category) \
+    reallocate(pointer, sizeof(type) * (old_count), 0, category)
 
-#define ALLOCATE(type, count) \
-    (type *)reallocate(NULL, 0, sizeof(type) * count)
+#define ALLOCATE(type, count, category) \
+    (type *)reallocate(NULL, 0, sizeof(type) * (count), category)
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer, category) \
+    reallocate(pointer, sizeof(type), 0, category)
 
-void *reallocate(void *pointer, size_t old_size, size_t new_size);
+// power-of-two buckets, the last one collects everything larger
+#define SIZE_CLASS_COUNT 32
+
+typedef enum {
+    MEM_CODE,
+    MEM_LINES,
+    MEM_CONSTANTS,
+    MEM_LOOPS,
+    MEM_TABLE,
+    MEM_STRING,
+    MEM_FUNCTION,
+    MEM_STACK,
+    MEM_LIST,
+    MEM_CLASS,
+    MEM_INSTANCE,
+    MEM_IMAGE,
+    MEM_CATEGORY_COUNT
+} MemoryCategory;
+
+typedef struct {
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t allocations;
+    size_t reallocations;
+    size_t frees;
+    // requests whose size rounds up to 2^(i-1) bytes
+    size_t size_classes[SIZE_CLASS_COUNT];
+} MemoryCounters;
+
+typedef struct {
+    MemoryCounters total;
+    MemoryCounters categories[MEM_CATEGORY_COUNT];
+} MemoryStats;
+
+void *reallocate(
+    void *pointer, size_t old_size, size_t new_size, MemoryCategory category
+);
+// Memory for objects: the heap cage with HEAP_CAGE, malloc otherwise.
+void *allocate_object_memory(size_t size, MemoryCategory category);
+void free_object_memory(void *object, size_t size, MemoryCategory category);
 void free_objects();
+// Records memory obtained outside of reallocate(), such as mappings.
+void track_memory(MemoryCategory category, size_t old_size, size_t new_size);
+
+// Snapshot of the allocator counters, cheap enough to poll from the host.
+const MemoryStats *memory_stats();
+void print_memory_stats(FILE *file);
 #endif
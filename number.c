@@ -0,0 +1,642 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "number.h"
+
+// Literals are parsed with Clinger's fast path when the digits and the
+// power of ten are both exact doubles, and with Eisel-Lemire (as in
+// fast_float) otherwise. strtod is left for more than 19 significant
+// digits and for fractions longer than the table below.
+//
+// Shortest round-trip formatting is done with Grisu3 (Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers"). Grisu3
+// gives up on roughly 0.5% of inputs, those fall back to searching the
+// shortest precision with snprintf and strtod.
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+typedef struct {
+    uint64_t f;
+    int16_t e;
+    int16_t k;
+} CachedPower;
+
+#define SIGNIFICAND_SIZE 52
+#define HIDDEN_BIT ((uint64_t)1 << SIGNIFICAND_SIZE)
+#define SIGNIFICAND_MASK (HIDDEN_BIT - 1)
+#define EXPONENT_BIAS (0x3FF + SIGNIFICAND_SIZE)
+#define DENORMAL_EXPONENT (-EXPONENT_BIAS + 1)
+
+// window the scaled value has to land in so digits fit in 32 bits
+#define MINIMAL_TARGET_EXPONENT (-60)
+#define MAXIMAL_TARGET_EXPONENT (-32)
+
+#define CACHED_POWERS_OFFSET 348
+#define CACHED_POWERS_DISTANCE 8
+#define D_1_LOG2_10 0.30102999566398114
+
+// normalized 10^k for k = -348, -340, ..., 340
+static const CachedPower cached_powers[] = {
+    {0xfa8fd5a0081c0288ull, -1220, -348},
+    {0xbaaee17fa23ebf76ull, -1193, -340},
+    {0x8b16fb203055ac76ull, -1166, -332},
+    {0xcf42894a5dce35eaull, -1140, -324},
+    {0x9a6bb0aa55653b2dull, -1113, -316},
+    {0xe61acf033d1a45dfull, -1087, -308},
+    {0xab70fe17c79ac6caull, -1060, -300},
+    {0xff77b1fcbebcdc4full, -1034, -292},
+    {0xbe5691ef416bd60cull, -1007, -284},
+    {0x8dd01fad907ffc3cull, -980, -276},
+    {0xd3515c2831559a83ull, -954, -268},
+    {0x9d71ac8fada6c9b5ull, -927, -260},
+    {0xea9c227723ee8bcbull, -901, -252},
+    {0xaecc49914078536dull, -874, -244},
+    {0x823c12795db6ce57ull, -847, -236},
+    {0xc21094364dfb5637ull, -821, -228},
+    {0x9096ea6f3848984full, -794, -220},
+    {0xd77485cb25823ac7ull, -768, -212},
+    {0xa086cfcd97bf97f4ull, -741, -204},
+    {0xef340a98172aace5ull, -715, -196},
+    {0xb23867fb2a35b28eull, -688, -188},
+    {0x84c8d4dfd2c63f3bull, -661, -180},
+    {0xc5dd44271ad3cdbaull, -635, -172},
+    {0x936b9fcebb25c996ull, -608, -164},
+    {0xdbac6c247d62a584ull, -582, -156},
+    {0xa3ab66580d5fdaf6ull, -555, -148},
+    {0xf3e2f893dec3f126ull, -529, -140},
+    {0xb5b5ada8aaff80b8ull, -502, -132},
+    {0x87625f056c7c4a8bull, -475, -124},
+    {0xc9bcff6034c13053ull, -449, -116},
+    {0x964e858c91ba2655ull, -422, -108},
+    {0xdff9772470297ebdull, -396, -100},
+    {0xa6dfbd9fb8e5b88full, -369, -92},
+    {0xf8a95fcf88747d94ull, -343, -84},
+    {0xb94470938fa89bcfull, -316, -76},
+    {0x8a08f0f8bf0f156bull, -289, -68},
+    {0xcdb02555653131b6ull, -263, -60},
+    {0x993fe2c6d07b7facull, -236, -52},
+    {0xe45c10c42a2b3b06ull, -210, -44},
+    {0xaa242499697392d3ull, -183, -36},
+    {0xfd87b5f28300ca0eull, -157, -28},
+    {0xbce5086492111aebull, -130, -20},
+    {0x8cbccc096f5088ccull, -103, -12},
+    {0xd1b71758e219652cull, -77, -4},
+    {0x9c40000000000000ull, -50, 4},
+    {0xe8d4a51000000000ull, -24, 12},
+    {0xad78ebc5ac620000ull, 3, 20},
+    {0x813f3978f8940984ull, 30, 28},
+    {0xc097ce7bc90715b3ull, 56, 36},
+    {0x8f7e32ce7bea5c70ull, 83, 44},
+    {0xd5d238a4abe98068ull, 109, 52},
+    {0x9f4f2726179a2245ull, 136, 60},
+    {0xed63a231d4c4fb27ull, 162, 68},
+    {0xb0de65388cc8ada8ull, 189, 76},
+    {0x83c7088e1aab65dbull, 216, 84},
+    {0xc45d1df942711d9aull, 242, 92},
+    {0x924d692ca61be758ull, 269, 100},
+    {0xda01ee641a708deaull, 295, 108},
+    {0xa26da3999aef774aull, 322, 116},
+    {0xf209787bb47d6b85ull, 348, 124},
+    {0xb454e4a179dd1877ull, 375, 132},
+    {0x865b86925b9bc5c2ull, 402, 140},
+    {0xc83553c5c8965d3dull, 428, 148},
+    {0x952ab45cfa97a0b3ull, 455, 156},
+    {0xde469fbd99a05fe3ull, 481, 164},
+    {0xa59bc234db398c25ull, 508, 172},
+    {0xf6c69a72a3989f5cull, 534, 180},
+    {0xb7dcbf5354e9beceull, 561, 188},
+    {0x88fcf317f22241e2ull, 588, 196},
+    {0xcc20ce9bd35c78a5ull, 614, 204},
+    {0x98165af37b2153dfull, 641, 212},
+    {0xe2a0b5dc971f303aull, 667, 220},
+    {0xa8d9d1535ce3b396ull, 694, 228},
+    {0xfb9b7cd9a4a7443cull, 720, 236},
+    {0xbb764c4ca7a44410ull, 747, 244},
+    {0x8bab8eefb6409c1aull, 774, 252},
+    {0xd01fef10a657842cull, 800, 260},
+    {0x9b10a4e5e9913129ull, 827, 268},
+    {0xe7109bfba19c0c9dull, 853, 276},
+    {0xac2820d9623bf429ull, 880, 284},
+    {0x80444b5e7aa7cf85ull, 907, 292},
+    {0xbf21e44003acdd2dull, 933, 300},
+    {0x8e679c2f5e44ff8full, 960, 308},
+    {0xd433179d9c8cb841ull, 986, 316},
+    {0x9e19db92b4e31ba9ull, 1013, 324},
+    {0xeb96bf6ebadf77d9ull, 1039, 332},
+    {0xaf87023b9bf0ee6bull, 1066, 340},
+};
+
+static DiyFp diy_subtract(DiyFp a, DiyFp b) {
+    return (DiyFp){.f = a.f - b.f, .e = a.e};
+}
+
+static DiyFp diy_multiply(DiyFp a, DiyFp b) {
+    // keeps the upper 64 bits of the product, rounded
+    uint128_t product = (uint128_t)a.f * b.f;
+    uint64_t high = (uint64_t)(product >> 64);
+    uint64_t low = (uint64_t)product;
+    high += low >> 63;
+    return (DiyFp){.f = high, .e = a.e + b.e + 64};
+}
+
+static DiyFp diy_normalize(DiyFp value) {
+    int shift = __builtin_clzll(value.f);
+    return (DiyFp){.f = value.f << shift, .e = value.e - shift};
+}
+
+static DiyFp double_to_diy(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t significand = bits & SIGNIFICAND_MASK;
+    int biased_exponent = (int)((bits >> SIGNIFICAND_SIZE) & 0x7FF);
+    if (biased_exponent == 0) {
+        return (DiyFp){.f = significand, .e = DENORMAL_EXPONENT};
+    }
+    return (DiyFp){
+        .f = significand + HIDDEN_BIT,
+        .e = biased_exponent - EXPONENT_BIAS
+    };
+}
+
+// m- and m+, the midpoints to the neighbouring doubles, with the same
+// normalized exponent.
+static void normalized_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus) {
+    DiyFp high = diy_normalize((DiyFp){.f = (v.f << 1) + 1, .e = v.e - 1});
+    DiyFp low;
+    // the lower neighbour is closer when v is a power of two
+    if (v.f == HIDDEN_BIT && v.e != DENORMAL_EXPONENT) {
+        low = (DiyFp){.f = (v.f << 2) - 1, .e = v.e - 2};
+    } else {
+        low = (DiyFp){.f = (v.f << 1) - 1, .e = v.e - 1};
+    }
+    low.f <<= low.e - high.e;
+    low.e = high.e;
+    *minus = low;
+    *plus = high;
+}
+
+static CachedPower cached_power(int min_exponent) {
+    double estimate = (min_exponent + 63) * D_1_LOG2_10;
+    int k = (int)estimate;
+    if (k < estimate) k++;
+    int index = (CACHED_POWERS_OFFSET + k - 1) / CACHED_POWERS_DISTANCE + 1;
+    return cached_powers[index];
+}
+
+static void biggest_power_ten(
+    uint32_t number, int bits, uint32_t *power, int *exponent_plus_one
+) {
+    static const uint32_t powers_of_ten[] = {
+        0, 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+        1000000000
+    };
+    // 1233/4096 approximates log10(2)
+    int guess = ((bits + 1) * 1233 >> 12) + 1;
+    if (number < powers_of_ten[guess]) guess--;
+    *power = powers_of_ten[guess];
+    *exponent_plus_one = guess;
+}
+
+static bool round_weed(
+    char *buffer, int length, uint64_t distance_too_high_w,
+    uint64_t unsafe_interval, uint64_t rest, uint64_t ten_kappa,
+    uint64_t unit
+) {
+    uint64_t small_distance = distance_too_high_w - unit;
+    uint64_t big_distance = distance_too_high_w + unit;
+    // move the last digit down while that gets closer to w
+    while (rest < small_distance
+           && unsafe_interval - rest >= ten_kappa
+           && (rest + ten_kappa < small_distance
+               || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        buffer[length - 1]--;
+        rest += ten_kappa;
+    }
+    // the imprecision of w makes the choice ambiguous
+    if (rest < big_distance
+        && unsafe_interval - rest >= ten_kappa
+        && (rest + ten_kappa < big_distance
+            || big_distance - rest > rest + ten_kappa - big_distance)) {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+static bool digit_gen(
+    DiyFp low, DiyFp w, DiyFp high, char *buffer, int *length, int *kappa
+) {
+    uint64_t unit = 1;
+    DiyFp too_low = {.f = low.f - unit, .e = low.e};
+    DiyFp too_high = {.f = high.f + unit, .e = high.e};
+    DiyFp unsafe_interval = diy_subtract(too_high, too_low);
+    DiyFp one = {.f = (uint64_t)1 << -w.e, .e = w.e};
+    uint32_t integrals = (uint32_t)(too_high.f >> -one.e);
+    uint64_t fractionals = too_high.f & (one.f - 1);
+
+    uint32_t divisor;
+    int divisor_exponent_plus_one;
+    biggest_power_ten(
+        integrals, 64 - (-one.e), &divisor, &divisor_exponent_plus_one
+    );
+    *kappa = divisor_exponent_plus_one;
+    *length = 0;
+
+    while (*kappa > 0) {
+        buffer[(*length)++] = (char)('0' + integrals / divisor);
+        integrals %= divisor;
+        (*kappa)--;
+        uint64_t rest = ((uint64_t)integrals << -one.e) + fractionals;
+        if (rest < unsafe_interval.f) {
+            return round_weed(
+                buffer, *length, diy_subtract(too_high, w).f,
+                unsafe_interval.f, rest, (uint64_t)divisor << -one.e, unit
+            );
+        }
+        divisor /= 10;
+    }
+
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval.f *= 10;
+        buffer[(*length)++] = (char)('0' + (fractionals >> -one.e));
+        fractionals &= one.f - 1;
+        (*kappa)--;
+        if (fractionals < unsafe_interval.f) {
+            return round_weed(
+                buffer, *length, diy_subtract(too_high, w).f * unit,
+                unsafe_interval.f, fractionals, one.f, unit
+            );
+        }
+    }
+}
+
+// Shortest digits of a positive finite double, value = digits * 10^exponent.
+static bool grisu3(double value, char *digits, int *length, int *exponent) {
+    DiyFp v = double_to_diy(value);
+    DiyFp minus, plus;
+    normalized_boundaries(v, &minus, &plus);
+    DiyFp w = diy_normalize(v);
+
+    CachedPower power = cached_power(MINIMAL_TARGET_EXPONENT - (w.e + 64));
+    DiyFp ten_mk = {.f = power.f, .e = power.e};
+
+    DiyFp scaled_w = diy_multiply(w, ten_mk);
+    DiyFp scaled_minus = diy_multiply(minus, ten_mk);
+    DiyFp scaled_plus = diy_multiply(plus, ten_mk);
+
+    int kappa;
+    bool result = digit_gen(
+        scaled_minus, scaled_w, scaled_plus, digits, length, &kappa
+    );
+    // ten_mk is 10^k, so the digits are scaled by 10^-k
+    *exponent = kappa - power.k;
+    return result;
+}
+
+static void shortest_fallback(
+    double value, char *digits, int *length, int *exponent
+) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+        if (precision == 17 || strtod(buffer, NULL) == value) break;
+    }
+    // buffer holds d[.ddd]e[+-]xx
+    *length = 0;
+    char *c = buffer;
+    for (; *c != 'e'; c++) {
+        if (*c != '.') digits[(*length)++] = *c;
+    }
+    int scientific = atoi(c + 1);
+    while (*length > 1 && digits[*length - 1] == '0') (*length)--;
+    *exponent = scientific - (*length - 1);
+}
+
+static int integer_digits(uint64_t integer, char *digits, int *exponent) {
+    char reversed[20];
+    int count = 0;
+    do {
+        reversed[count++] = (char)('0' + integer % 10);
+        integer /= 10;
+    } while (integer != 0);
+
+    // trailing zeros move into the exponent
+    int zeros = 0;
+    while (zeros < count - 1 && reversed[zeros] == '0') zeros++;
+    int length = 0;
+    for (int i = count - 1; i >= zeros; i--) {
+        digits[length++] = reversed[i];
+    }
+    *exponent = zeros;
+    return length;
+}
+
+static int write_exponent(char *buffer, int exponent) {
+    int length = 0;
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0) exponent = -exponent;
+    if (exponent >= 100) {
+        buffer[length++] = (char)('0' + exponent / 100);
+        exponent %= 100;
+    }
+    buffer[length++] = (char)('0' + exponent / 10);
+    buffer[length++] = (char)('0' + exponent % 10);
+    return length;
+}
+
+// Lays out digits * 10^exponent the way %g does, with precision
+// max(6, number of digits) so no digit is ever dropped.
+static int layout(
+    const char *digits, int count, int exponent, char *buffer
+) {
+    int scientific = count - 1 + exponent;
+    int precision = count > 6 ? count : 6;
+    int length = 0;
+
+    if (scientific < -4 || scientific >= precision) {
+        buffer[length++] = digits[0];
+        if (count > 1) {
+            buffer[length++] = '.';
+            memcpy(buffer + length, digits + 1, count - 1);
+            length += count - 1;
+        }
+        return length + write_exponent(buffer + length, scientific);
+    }
+
+    if (scientific < 0) {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        for (int i = -1; i > scientific; i--) {
+            buffer[length++] = '0';
+        }
+        memcpy(buffer + length, digits, count);
+        return length + count;
+    }
+
+    int integral = scientific + 1;
+    if (count <= integral) {
+        memcpy(buffer + length, digits, count);
+        length += count;
+        for (int i = count; i < integral; i++) {
+            buffer[length++] = '0';
+        }
+        return length;
+    }
+    memcpy(buffer + length, digits, integral);
+    length += integral;
+    buffer[length++] = '.';
+    memcpy(buffer + length, digits + integral, count - integral);
+    return length + count - integral;
+}
+
+int format_number(double value, char *buffer) {
+    int length = 0;
+    if (signbit(value)) {
+        buffer[length++] = '-';
+        value = -value;
+    }
+    if (isnan(value)) {
+        memcpy(buffer + length, "nan", 3);
+        return length + 3;
+    }
+    if (isinf(value)) {
+        memcpy(buffer + length, "inf", 3);
+        return length + 3;
+    }
+    if (value == 0) {
+        buffer[length++] = '0';
+        return length;
+    }
+
+    char digits[20];
+    int count;
+    int exponent;
+    if (value < (double)HIDDEN_BIT * 2 && value == (double)(uint64_t)value) {
+        count = integer_digits((uint64_t)value, digits, &exponent);
+    } else if (!grisu3(value, digits, &count, &exponent)) {
+        shortest_fallback(value, digits, &count, &exponent);
+    }
+    return length + layout(digits, count, exponent, buffer + length);
+}
+
+int format_integer(int32_t value, char *buffer) {
+    // beyond six digits %g may switch to an exponent
+    if (value <= -1000000 || value >= 1000000) {
+        return format_number(value, buffer);
+    }
+    int length = 0;
+    if (value < 0) {
+        buffer[length++] = '-';
+        value = -value;
+    }
+    char reversed[6];
+    int count = 0;
+    do {
+        reversed[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        buffer[length++] = reversed[--count];
+    }
+    return length;
+}
+
+#define MAX_MANTISSA_DIGITS 19
+#define MIN_POWER_OF_FIVE (-64)
+#define MANTISSA_EXPLICIT_BITS 52
+#define MINIMUM_EXPONENT (-1023)
+#define INFINITE_POWER 0x7FF
+
+// 128-bit truncated 5^q for q = -64, ..., 0, most significant bit set
+static const uint64_t powers_of_five[][2] = {
+    {0xa87fea27a539e9a5ull, 0x3f2398d747b36224ull},
+    {0xd29fe4b18e88640eull, 0x8eec7f0d19a03aadull},
+    {0x83a3eeeef9153e89ull, 0x1953cf68300424acull},
+    {0xa48ceaaab75a8e2bull, 0x5fa8c3423c052dd7ull},
+    {0xcdb02555653131b6ull, 0x3792f412cb06794dull},
+    {0x808e17555f3ebf11ull, 0xe2bbd88bbee40bd0ull},
+    {0xa0b19d2ab70e6ed6ull, 0x5b6aceaeae9d0ec4ull},
+    {0xc8de047564d20a8bull, 0xf245825a5a445275ull},
+    {0xfb158592be068d2eull, 0xeed6e2f0f0d56712ull},
+    {0x9ced737bb6c4183dull, 0x55464dd69685606bull},
+    {0xc428d05aa4751e4cull, 0xaa97e14c3c26b886ull},
+    {0xf53304714d9265dfull, 0xd53dd99f4b3066a8ull},
+    {0x993fe2c6d07b7fabull, 0xe546a8038efe4029ull},
+    {0xbf8fdb78849a5f96ull, 0xde98520472bdd033ull},
+    {0xef73d256a5c0f77cull, 0x963e66858f6d4440ull},
+    {0x95a8637627989aadull, 0xdde7001379a44aa8ull},
+    {0xbb127c53b17ec159ull, 0x5560c018580d5d52ull},
+    {0xe9d71b689dde71afull, 0xaab8f01e6e10b4a6ull},
+    {0x9226712162ab070dull, 0xcab3961304ca70e8ull},
+    {0xb6b00d69bb55c8d1ull, 0x3d607b97c5fd0d22ull},
+    {0xe45c10c42a2b3b05ull, 0x8cb89a7db77c506aull},
+    {0x8eb98a7a9a5b04e3ull, 0x77f3608e92adb242ull},
+    {0xb267ed1940f1c61cull, 0x55f038b237591ed3ull},
+    {0xdf01e85f912e37a3ull, 0x6b6c46dec52f6688ull},
+    {0x8b61313bbabce2c6ull, 0x2323ac4b3b3da015ull},
+    {0xae397d8aa96c1b77ull, 0xabec975e0a0d081aull},
+    {0xd9c7dced53c72255ull, 0x96e7bd358c904a21ull},
+    {0x881cea14545c7575ull, 0x7e50d64177da2e54ull},
+    {0xaa242499697392d2ull, 0xdde50bd1d5d0b9e9ull},
+    {0xd4ad2dbfc3d07787ull, 0x955e4ec64b44e864ull},
+    {0x84ec3c97da624ab4ull, 0xbd5af13bef0b113eull},
+    {0xa6274bbdd0fadd61ull, 0xecb1ad8aeacdd58eull},
+    {0xcfb11ead453994baull, 0x67de18eda5814af2ull},
+    {0x81ceb32c4b43fcf4ull, 0x80eacf948770ced7ull},
+    {0xa2425ff75e14fc31ull, 0xa1258379a94d028dull},
+    {0xcad2f7f5359a3b3eull, 0x096ee45813a04330ull},
+    {0xfd87b5f28300ca0dull, 0x8bca9d6e188853fcull},
+    {0x9e74d1b791e07e48ull, 0x775ea264cf55347eull},
+    {0xc612062576589ddaull, 0x95364afe032a819eull},
+    {0xf79687aed3eec551ull, 0x3a83ddbd83f52205ull},
+    {0x9abe14cd44753b52ull, 0xc4926a9672793543ull},
+    {0xc16d9a0095928a27ull, 0x75b7053c0f178294ull},
+    {0xf1c90080baf72cb1ull, 0x5324c68b12dd6339ull},
+    {0x971da05074da7beeull, 0xd3f6fc16ebca5e04ull},
+    {0xbce5086492111aeaull, 0x88f4bb1ca6bcf585ull},
+    {0xec1e4a7db69561a5ull, 0x2b31e9e3d06c32e6ull},
+    {0x9392ee8e921d5d07ull, 0x3aff322e62439fd0ull},
+    {0xb877aa3236a4b449ull, 0x09befeb9fad487c3ull},
+    {0xe69594bec44de15bull, 0x4c2ebe687989a9b4ull},
+    {0x901d7cf73ab0acd9ull, 0x0f9d37014bf60a11ull},
+    {0xb424dc35095cd80full, 0x538484c19ef38c95ull},
+    {0xe12e13424bb40e13ull, 0x2865a5f206b06fbaull},
+    {0x8cbccc096f5088cbull, 0xf93f87b7442e45d4ull},
+    {0xafebff0bcb24aafeull, 0xf78f69a51539d749ull},
+    {0xdbe6fecebdedd5beull, 0xb573440e5a884d1cull},
+    {0x89705f4136b4a597ull, 0x31680a88f8953031ull},
+    {0xabcc77118461cefcull, 0xfdc20d2b36ba7c3eull},
+    {0xd6bf94d5e57a42bcull, 0x3d32907604691b4dull},
+    {0x8637bd05af6c69b5ull, 0xa63f9a49c2c1b110ull},
+    {0xa7c5ac471b478423ull, 0x0fcf80dc33721d54ull},
+    {0xd1b71758e219652bull, 0xd3c36113404ea4a9ull},
+    {0x83126e978d4fdf3bull, 0x645a1cac083126eaull},
+    {0xa3d70a3d70a3d70aull, 0x3d70a3d70a3d70a4ull},
+    {0xccccccccccccccccull, 0xcccccccccccccccdull},
+    {0x8000000000000000ull, 0x0000000000000000ull},
+};
+
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Correctly rounded w * 10^q, false if it can't be decided here.
+static bool eisel_lemire(uint64_t w, int q, double *result) {
+    int lz = __builtin_clzll(w);
+    w <<= lz;
+
+    const uint64_t *power = powers_of_five[q - MIN_POWER_OF_FIVE];
+    uint128_t first = (uint128_t)w * power[0];
+    uint64_t high = (uint64_t)(first >> 64);
+    uint64_t low = (uint64_t)first;
+    // the bits below the mantissa are all ones, the truncated part of
+    // 5^q may still carry into them
+    uint64_t precision_mask = UINT64_MAX >> (MANTISSA_EXPLICIT_BITS + 3);
+    if ((high & precision_mask) == precision_mask) {
+        uint128_t second = (uint128_t)w * power[1];
+        uint64_t second_high = (uint64_t)(second >> 64);
+        low += second_high;
+        if (second_high > low) high++;
+    }
+    if (low == UINT64_MAX && (q < -27 || q > 55)) {
+        return false;
+    }
+
+    int upperbit = (int)(high >> 63);
+    int shift = upperbit + 64 - MANTISSA_EXPLICIT_BITS - 3;
+    uint64_t mantissa = high >> shift;
+    // (217706 * q) >> 16 is floor(q * log2(10))
+    int power2 = (((152170 + 65536) * q) >> 16) + 63
+        + upperbit - lz - MINIMUM_EXPONENT;
+    if (power2 <= 0) {
+        return false;
+    }
+
+    // exactly halfway between two doubles: round to even
+    if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1
+        && (mantissa << shift) == high) {
+        mantissa &= ~(uint64_t)1;
+    }
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (uint64_t)2 << MANTISSA_EXPLICIT_BITS) {
+        mantissa = (uint64_t)1 << MANTISSA_EXPLICIT_BITS;
+        power2++;
+    }
+    mantissa &= ~((uint64_t)1 << MANTISSA_EXPLICIT_BITS);
+    if (power2 >= INFINITE_POWER) {
+        return false;
+    }
+
+    uint64_t bits = mantissa | (uint64_t)power2 << MANTISSA_EXPLICIT_BITS;
+    memcpy(result, &bits, sizeof(bits));
+    return true;
+}
+
+static double parse_number_slow(const char *start, int length) {
+    // the token is not terminated, and strtod would happily continue
+    // into something like `1e5` or `0x1`
+    char small[64];
+    char *buffer = length < (int)sizeof(small) ? small : malloc(length + 1);
+    memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    double value = strtod(buffer, NULL);
+    if (buffer != small) free(buffer);
+    return value;
+}
+
+double parse_number(const char *start, int length) {
+    const char *c = start;
+    const char *end = start + length;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+
+    while (c < end && *c == '0') c++;
+    for (; c < end && *c != '.'; c++) {
+        mantissa = mantissa * 10 + (uint64_t)(*c - '0');
+        digits++;
+    }
+    if (c < end) {
+        const char *fraction = ++c;
+        if (mantissa == 0) {
+            // leading zeros of the fraction are not significant either
+            while (c < end && *c == '0') c++;
+        }
+        for (; c < end; c++) {
+            mantissa = mantissa * 10 + (uint64_t)(*c - '0');
+            digits++;
+        }
+        exponent = -(int)(end - fraction);
+    }
+
+    if (digits > MAX_MANTISSA_DIGITS) {
+        return parse_number_slow(start, length);
+    }
+    if (mantissa == 0) {
+        return 0.0;
+    }
+    if (mantissa <= (uint64_t)1 << 53) {
+        if (exponent == 0) {
+            return (double)mantissa;
+        }
+        if (exponent >= -22) {
+            return (double)mantissa / exact_powers_of_ten[-exponent];
+        }
+    }
+
+    double value;
+    if (exponent >= MIN_POWER_OF_FIVE && eisel_lemire(mantissa, exponent, &value)) {
+        return value;
+    }
+    return parse_number_slow(start, length);
+}
@@ -0,0 +1,20 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include "common.h"
+
+// Large enough for any double: sign, 17 digits, point and exponent.
+#define NUMBER_BUFFER_SIZE 32
+
+// Writes the shortest representation of `value` that reads back as the
+// same double, laid out like printf("%g") with as much precision as the
+// digits need. Returns the length, the buffer is not NUL-terminated.
+int format_number(double value, char *buffer);
+// The same for a number known to be an int.
+int format_integer(int32_t value, char *buffer);
+
+// Converts a number literal as accepted by the scanner, digits with an
+// optional fraction, to the nearest double.
+double parse_number(const char *start, int length);
+
+#endif
@@ -1,7 +1,10 @@
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "intern.h"
 #include "memory.h"
+#include "output.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
@@ -15,23 +18,146 @@ static uint32_t hash_string(const char *key, int length) {
     return hash;
 }
 
-static Object *allocate_object(size_t size, ObjectType type) {
-    Object *object = (Object *)reallocate(NULL, 0, size);
+static Object *allocate_object(
+    size_t size, ObjectType type, MemoryCategory category
+) {
+    Object *object = (Object *)allocate_object_memory(size, category);
     object->type = type;
+    object->flags = 0;
     object->next = vm.objects;
-    vm.objects = object;
+    vm.objects = OBJECT_REF(object);
     return object;
 }
 
 String *make_string(int length) {
-    String *string = 
-        (String *)allocate_object(sizeof(String) + length + 1, STRING);
+    String *string = (String *)allocate_object(
+        sizeof(String) + length + 1, STRING, MEM_STRING
+    );
     string->length = length;
     return string;
 }
 
+static inline size_t function_table_size(uint32_t capacity) {
+    return sizeof(FunctionTable) + sizeof(Function *) * capacity;
+}
+
+void register_function(Function *function) {
+    FunctionTable *table = vm.functions;
+    uint32_t capacity = table == NULL ? 0 : table->capacity;
+    if (function->id >= capacity) {
+        uint32_t new_capacity = capacity < 8 ? 8 : 2 * capacity;
+        while (new_capacity <= function->id) new_capacity *= 2;
+        FunctionTable *bigger = (FunctionTable *)reallocate(
+            NULL, 0, function_table_size(new_capacity), MEM_FUNCTION
+        );
+        bigger->capacity = new_capacity;
+        memset(bigger->functions, 0, sizeof(Function *) * new_capacity);
+        if (table != NULL) {
+            memcpy(bigger->functions, table->functions,
+                sizeof(Function *) * capacity);
+        }
+        // a signal sees either table whole
+        atomic_signal_fence(memory_order_release);
+        vm.functions = bigger;
+        if (table != NULL) {
+            reallocate(table, function_table_size(capacity), 0, MEM_FUNCTION);
+        }
+        table = bigger;
+    }
+    table->functions[function->id] = function;
+}
+
+void free_function_table() {
+    if (vm.functions != NULL) {
+        reallocate(vm.functions, function_table_size(vm.functions->capacity),
+            0, MEM_FUNCTION);
+        vm.functions = NULL;
+    }
+}
+
+Function *new_function() {
+    Function *function = (Function *)allocate_object(
+        sizeof(Function), FUNCTION, MEM_FUNCTION
+    );
+    function->id = vm.next_function_id++;
+    function->arity = 0;
+    function->name = NULL;
+    init_chunk(&function->chunk, true);
+    register_function(function);
+    return function;
+}
+
+Native *new_native(String *name, int arity, NativeFunction function) {
+    Native *native = (Native *)allocate_object(
+        sizeof(Native), NATIVE, MEM_FUNCTION
+    );
+    native->arity = arity;
+    native->function = function;
+    native->name = name;
+    return native;
+}
+
+List *new_list(int count) {
+    List *list = (List *)allocate_object(sizeof(List), LIST, MEM_LIST);
+    list->count = count;
+    list->capacity = count;
+    list->values = count == 0 ? NULL : ALLOCATE(Value, count, MEM_LIST);
+    return list;
+}
+
+Map *new_map() {
+    Map *map = (Map *)allocate_object(sizeof(Map), MAP, MEM_TABLE);
+    map->count = 0;
+    init_value_table(&map->table);
+    return map;
+}
+
+Class *new_class(String *name) {
+    Class *klass = (Class *)allocate_object(sizeof(Class), CLASS, MEM_CLASS);
+    klass->name = name;
+    klass->superclass = NULL;
+    init_table(&klass->methods, false);
+    klass->initializer = NULL;
+    klass->slot_hint = 0;
+    klass->shape = new_shape(klass, NULL, NULL);
+    return klass;
+}
+
+Shape *new_shape(Class *klass, Shape *parent, String *name) {
+    Shape *shape = (Shape *)allocate_object(sizeof(Shape), SHAPE, MEM_CLASS);
+    shape->klass = klass;
+    shape->parent = parent;
+    shape->name = name;
+    shape->count = parent == NULL ? 0 : parent->count + 1;
+    init_table(&shape->transitions, false);
+    return shape;
+}
+
+Instance *new_instance(Class *klass) {
+    Instance *instance = (Instance *)allocate_object(
+        sizeof(Instance), INSTANCE, MEM_INSTANCE
+    );
+    instance->shape = klass->shape;
+    instance->capacity = klass->slot_hint;
+    instance->fields = klass->slot_hint == 0
+        ? NULL : ALLOCATE(Value, klass->slot_hint, MEM_INSTANCE);
+    return instance;
+}
+
+BoundMethod *new_bound_method(Value receiver, Function *method) {
+    BoundMethod *bound = (BoundMethod *)allocate_object(
+        sizeof(BoundMethod), BOUND_METHOD, MEM_CLASS
+    );
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
 String *copy_string(const char *buffer, int length) {
     uint32_t hash = hash_string(buffer, length);
+#ifdef SHARED_STRINGS
+    return shared_intern(buffer, length, hash);
+#else
     // check if string is already interned
     String *string = table_find_string(&vm.strings, buffer, length, hash);
     if (string != NULL) {
@@ -39,16 +165,222 @@ String *copy_string(const char *buffer, int length) {
     }
     string = make_string(length);
     string->hash = hash;
+    string->object.flags = STRING_HASHED | STRING_INTERNED;
     memcpy(string->data, buffer, length);
     string->data[length] = '\0';
     table_set(&vm.strings, string, NIL_VAL);
     return string;
+#endif
+}
+
+String *borrow_string(const char *data, int length) {
+#ifdef SHARED_STRINGS
+    // the shared table outlives any one source
+    return copy_string(data, length);
+#else
+    // a pointer takes more room than a short name
+    if (length < (int)sizeof(const char *)) {
+        return copy_string(data, length);
+    }
+    uint32_t hash = hash_string(data, length);
+    String *string = table_find_string(&vm.strings, data, length, hash);
+    if (string != NULL) {
+        return string;
+    }
+    string = (String *)allocate_object(
+        sizeof(String) + sizeof(const char *), STRING, MEM_STRING
+    );
+    string->length = length;
+    string->hash = hash;
+    string->object.flags = STRING_HASHED | STRING_INTERNED | STRING_BORROWED;
+    memcpy(string->data, &data, sizeof(data));
+    table_set(&vm.strings, string, NIL_VAL);
+    vm.borrowed_count++;
+    return string;
+#endif
+}
+
+static void release_string(String *string) {
+    char *copy = ALLOCATE(char, string->length + 1, MEM_STRING);
+    memcpy(copy, string_chars(string), string->length);
+    copy[string->length] = '\0';
+    memcpy(string->data, &copy, sizeof(copy));
+    string->object.flags |= STRING_RELEASED;
+    vm.borrowed_count--;
+}
+
+static inline bool is_borrowed(Object *object) {
+    return object->type == STRING
+        && (object->flags & (STRING_BORROWED | STRING_RELEASED))
+            == STRING_BORROWED;
+}
+
+void release_sources() {
+    // only what was borrowed since the last release is left, at the front
+    for (ObjectRef ref = vm.objects; vm.borrowed_count > 0;
+         ref = OBJECT_PTR(ref)->next) {
+        if (is_borrowed(OBJECT_PTR(ref))) {
+            release_string((String *)OBJECT_PTR(ref));
+        }
+    }
+}
+
+const char *string_cstring(String *string) {
+    if (is_borrowed(&string->object)) {
+        release_string(string);
+    }
+    return string_chars(string);
+}
+
+uint32_t string_hash(String *string) {
+    if (!(string->object.flags & STRING_HASHED)) {
+        string->hash = hash_string(string->data, string->length);
+        string->object.flags |= STRING_HASHED;
+    }
+    return string->hash;
+}
+
+String *find_interned(String *string) {
+    if (string->object.flags & STRING_INTERNED) {
+        return string;
+    }
+#ifdef SHARED_STRINGS
+    return shared_find(string->data, string->length, string_hash(string));
+#else
+    return table_find_string(
+        &vm.strings, string->data, string->length, string_hash(string)
+    );
+#endif
+}
+
+String *intern_string(String *string) {
+#ifdef SHARED_STRINGS
+    // the shared table outlives this VM's objects, so it gets a copy
+    if (string->object.flags & STRING_INTERNED) {
+        return string;
+    }
+    return shared_intern(string->data, string->length, string_hash(string));
+#else
+    String *interned = find_interned(string);
+    if (interned != NULL) {
+        return interned;
+    }
+    string->object.flags |= STRING_INTERNED;
+    table_set(&vm.strings, string, NIL_VAL);
+    return string;
+#endif
+}
+
+Value string_value(const char *data, int length) {
+    if (length <= SMALL_STRING_MAX) {
+        return small_string(data, length);
+    }
+    return OBJECT_VAL(copy_string(data, length));
+}
+
+// Lists and maps that are being printed, so one that contains itself
+// shows up as [...] or {...} instead of recursing forever. Deeper nesting
+// is cut off the same way.
+#define PRINT_DEPTH 64
+static Object *printing[PRINT_DEPTH];
+static int printing_count;
+
+// false if `object` is already being printed
+static bool begin_printing(Object *object, const char *cut) {
+    for (int i = 0; i < printing_count; i++) {
+        if (printing[i] == object) {
+            write_output(&vm.output, cut, 5);
+            return false;
+        }
+    }
+    if (printing_count == PRINT_DEPTH) {
+        write_output(&vm.output, cut, 5);
+        return false;
+    }
+    printing[printing_count++] = object;
+    return true;
+}
+
+static void print_list(List *list) {
+    if (!begin_printing(&list->object, "[...]")) {
+        return;
+    }
+    write_output(&vm.output, "[", 1);
+    for (int i = 0; i < list->count; i++) {
+        if (i > 0) write_output(&vm.output, ", ", 2);
+        print_value(list->values[i]);
+    }
+    write_output(&vm.output, "]", 1);
+    printing_count--;
+}
+
+// in table order
+static void print_map(Map *map) {
+    if (!begin_printing(&map->object, "{...}")) {
+        return;
+    }
+    write_output(&vm.output, "{", 1);
+    bool first = true;
+    for (int i = 0; i < map->table.capacity; i++) {
+        if (!value_table_has_entry(&map->table, i)) continue;
+        if (!first) write_output(&vm.output, ", ", 2);
+        first = false;
+        print_value(map->table.keys[i]);
+        write_output(&vm.output, ": ", 2);
+        print_value(map->table.values[i]);
+    }
+    write_output(&vm.output, "}", 1);
+    printing_count--;
+}
+
+static void print_function(Function *function) {
+    if (function->name == NULL) {
+        write_output(&vm.output, "<script>", 8);
+        return;
+    }
+    write_output(&vm.output, "<fn ", 4);
+    write_output(
+        &vm.output, string_chars(function->name), function->name->length
+    );
+    write_output(&vm.output, ">", 1);
 }
 
 void print_object(Value value) {
     switch (OBJECT_TYPE(value)) {
-        case STRING:
-            printf("%s", AS_CSTRING(value));
+        case STRING: {
+            String *string = AS_STRING(value);
+            write_output(&vm.output, string_chars(string), string->length);
+            break;
+        }
+        case FUNCTION:
+            print_function(AS_FUNCTION(value));
+            break;
+        case NATIVE: {
+            String *name = AS_NATIVE(value)->name;
+            write_output(&vm.output, "<native fn ", 11);
+            write_output(&vm.output, string_chars(name), name->length);
+            write_output(&vm.output, ">", 1);
+            break;
+        }
+        case LIST:
+            print_list(AS_LIST(value));
+            break;
+        case MAP:
+            print_map(AS_MAP(value));
+            break;
+        case CLASS: {
+            String *name = AS_CLASS(value)->name;
+            write_output(&vm.output, string_chars(name), name->length);
+            break;
+        }
+        case INSTANCE: {
+            String *name = AS_INSTANCE(value)->shape->klass->name;
+            write_output(&vm.output, string_chars(name), name->length);
+            write_output(&vm.output, " instance", 9);
+            break;
+        }
+        case BOUND_METHOD:
+            print_function(AS_BOUND_METHOD(value)->method);
             break;
         default:
             UNREACHABLE();
@@ -1,22 +1,66 @@
 #ifndef OBJECT_H
 #define OBJECT_H
 
+#include <string.h>
 #include "common.h"
+#include "chunk.h"
+#include "table.h"
 #include "value.h"
 
-#define IS_STRING(value) (is_objecttype(value, STRING))
-#define AS_CSTRING(value) ((AS_STRING(value))->data)
+// small or on the heap, AS_STRING() is only for the latter
+#define IS_STRING(value) \
+    (IS_SMALL_STRING(value) || is_objecttype(value, STRING))
+#define IS_FUNCTION(value) (is_objecttype(value, FUNCTION))
+#define IS_NATIVE(value) (is_objecttype(value, NATIVE))
+#define IS_LIST(value) (is_objecttype(value, LIST))
+#define IS_MAP(value) (is_objecttype(value, MAP))
+#define IS_CLASS(value) (is_objecttype(value, CLASS))
+#define IS_INSTANCE(value) (is_objecttype(value, INSTANCE))
+#define IS_BOUND_METHOD(value) (is_objecttype(value, BOUND_METHOD))
+#define AS_CSTRING(value) string_cstring(AS_STRING(value))
 #define AS_STRING(value) (((String *)AS_OBJECT(value)))
+#define AS_FUNCTION(value) (((Function *)AS_OBJECT(value)))
+#define AS_NATIVE(value) (((Native *)AS_OBJECT(value)))
+#define AS_LIST(value) (((List *)AS_OBJECT(value)))
+#define AS_MAP(value) (((Map *)AS_OBJECT(value)))
+#define AS_CLASS(value) (((Class *)AS_OBJECT(value)))
+#define AS_INSTANCE(value) (((Instance *)AS_OBJECT(value)))
+#define AS_BOUND_METHOD(value) (((BoundMethod *)AS_OBJECT(value)))
 
 typedef enum {
-    STRING
+    STRING,
+    FUNCTION,
+    NATIVE,
+    LIST,
+    MAP,
+    CLASS,
+    SHAPE,
+    INSTANCE,
+    BOUND_METHOD
 } ObjectType;
 
+// With HEAP_CAGE the header is a single 8-byte word: type and flags
+// leave two spare bytes next to the 32-bit link.
 struct Object {
-    ObjectType type;
-    struct Object *next;
+    uint8_t type; // ObjectType
+    uint8_t flags; // per type, see STRING_HASHED
+    ObjectRef next;
 };
 
+// String object flags
+#define STRING_HASHED 1
+#define STRING_INTERNED 2
+// data holds a pointer to the characters instead of the characters: into
+// a source buffer (see borrow_string()), or with STRING_RELEASED to a copy
+// the string owns
+#define STRING_BORROWED 4
+#define STRING_RELEASED 8
+
+// Literals and names are interned when they are made. Strings built at
+// runtime start with neither flag and get them on demand: the hash with
+// string_hash(), the interned copy with intern_string(). Read the
+// characters through string_chars(), borrowed ones are not followed by a
+// '\0'.
 struct String {
     Object object;
     int length;
@@ -24,12 +68,169 @@ struct String {
     char data[];
 };
 
+static inline const char *string_chars(const String *string) {
+    if UNLIKELY(string->object.flags & STRING_BORROWED) {
+        const char *chars;
+        memcpy(&chars, string->data, sizeof(chars));
+        return chars;
+    }
+    return string->data;
+}
+
+typedef struct {
+    Object object;
+    // numbered in the order they are compiled, see flight.h
+    uint32_t id;
+    int arity;
+    Chunk chunk;
+    // NULL for the top-level script
+    String *name;
+} Function;
+
+// Every function by id, NULL for ids not in use. The flight recorder reads
+// it from a signal handler, so a bigger table is filled in before it is
+// swapped in with a single store, and entries are only ever added.
+typedef struct {
+    uint32_t capacity;
+    Function *functions[];
+} FunctionTable;
+
+// Natives run on the caller's stack: `args` holds the arity's worth of
+// arguments and the result goes in args[-1], over the callee. On failure
+// they report a runtime error themselves and return false.
+typedef bool (*NativeFunction)(Value *args);
+
+typedef struct {
+    Object object;
+    int arity;
+    NativeFunction function;
+    String *name;
+} Native;
+
+// The elements are contiguous, `capacity` of them allocated.
+typedef struct {
+    Object object;
+    int count;
+    int capacity;
+    Value *values;
+} List;
+
+typedef struct {
+    Object object;
+    // entries, table.count also has the tombstones
+    int count;
+    ValueTable table;
+} Map;
+
+typedef struct Class Class;
+typedef struct Shape Shape;
+
+// Instances keep their fields in a flat array laid out by their shape (a
+// hidden class): the class and the names of the fields in the order they
+// were added. Adding a field moves the instance along a transition to the
+// shape with that field too, and instances filled in the same order share
+// every shape on the way. So the shape alone says where a field lives,
+// which is what the property caches key on, see chunk.h.
+struct Shape {
+    Object object;
+    Class *klass;
+    // NULL for the class's shape with no fields
+    Shape *parent;
+    // the field added over `parent`, kept in slot `count - 1`
+    String *name;
+    int count;
+    // field name -> the shape with that field added
+    Table transitions;
+};
+
+// Methods are fixed once the class declaration has run, so a cached
+// method stays valid as long as the shape it was found for.
+struct Class {
+    Object object;
+    String *name;
+    // NULL without one
+    Class *superclass;
+    // only the class's own, inherited ones are found through `superclass`
+    Table methods;
+    // `init`, the class's own or inherited, NULL without one
+    Function *initializer;
+    // of new instances, which have no fields
+    Shape *shape;
+    // the most fields an instance has had, new instances get room for them
+    int slot_hint;
+};
+
+typedef struct {
+    Object object;
+    Shape *shape;
+    // shape->count of them are in use
+    int capacity;
+    Value *fields;
+} Instance;
+
+typedef struct {
+    Object object;
+    Value receiver;
+    Function *method;
+} BoundMethod;
+
 static inline bool is_objecttype(Value value, ObjectType type) {
     return IS_OBJECT(value) && AS_OBJECT(value)->type == type;
 }
 
+// The bytes of a string value, small or not. A small string's bytes live
+// in `value`, so it has to outlive their use.
+static inline const char *string_data(const Value *value, int *length) {
+    if (IS_SMALL_STRING(*value)) {
+        *length = SMALL_STRING_LENGTH(*value);
+        return SMALL_STRING_DATA(*value);
+    }
+    *length = AS_STRING(*value)->length;
+    return string_chars(AS_STRING(*value));
+}
+
+// For string values: small when they fit, interned on the heap otherwise.
+// Anything that needs a String * (table keys, names) uses copy_string().
+Value string_value(const char *data, int length);
 String *copy_string(const char *data, int length);
+// Like copy_string(), but a new string points at `data` instead of copying
+// it: names and literals in a source buffer. The buffer has to outlive the
+// string or be given up with release_sources() first.
+String *borrow_string(const char *data, int length);
+// copies the characters of every borrowed string out of its source
+void release_sources();
+// The characters followed by a '\0', for messages and reports. A borrowed
+// string is copied out of its source for that.
+const char *string_cstring(String *string);
 String *make_string(int length);
+uint32_t string_hash(String *string);
+// the interned string equal to `string`, which is interned itself if
+// there is none yet (a copy of it with SHARED_STRINGS, see intern.h)
+String *intern_string(String *string);
+// the interned string equal to `string`, NULL if there is none
+String *find_interned(String *string);
+Function *new_function();
+// puts a function made elsewhere, such as in an image, in vm.functions
+void register_function(Function *function);
+void free_function_table();
+Native *new_native(String *name, int arity, NativeFunction function);
+// `count` elements, left for the caller to fill in
+List *new_list(int count);
+Map *new_map();
+Class *new_class(String *name);
+Shape *new_shape(Class *klass, Shape *parent, String *name);
+// with room for klass->slot_hint fields
+Instance *new_instance(Class *klass);
+BoundMethod *new_bound_method(Value receiver, Function *method);
 void print_object(Value value);
+
+// A heap string value swapped for its interned copy, anything else as is.
+static inline Value intern_value(Value value) {
+    if (is_objecttype(value, STRING)
+        && !(AS_OBJECT(value)->flags & STRING_INTERNED)) {
+        return OBJECT_VAL(intern_string(AS_STRING(value)));
+    }
+    return value;
+}
 #endif
 
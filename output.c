@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include "output.h"
+
+void init_output(OutputBuffer *output) {
+    output->length = 0;
+}
+
+void flush_output(OutputBuffer *output) {
+    if (output->length > 0) {
+        fwrite(output->data, 1, output->length, stdout);
+        output->length = 0;
+    }
+    fflush(stdout);
+}
+
+void write_output_slow(OutputBuffer *output, const char *data, size_t length) {
+    flush_output(output);
+    if (length >= OUTPUT_BUFFER_SIZE) {
+        fwrite(data, 1, length, stdout);
+        return;
+    }
+    memcpy(output->data, data, length);
+    output->length = length;
+}
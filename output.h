@@ -0,0 +1,31 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <string.h>
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE 8192
+
+// Program output is collected here and handed to stdout a block at a
+// time, so `print` costs a memcpy instead of a locked stdio call.
+typedef struct {
+    size_t length;
+    char data[OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
+void init_output(OutputBuffer *output);
+void flush_output(OutputBuffer *output);
+void write_output_slow(OutputBuffer *output, const char *data, size_t length);
+
+static inline void write_output(
+    OutputBuffer *output, const char *data, size_t length
+) {
+    if UNLIKELY(output->length + length > OUTPUT_BUFFER_SIZE) {
+        write_output_slow(output, data, length);
+        return;
+    }
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <string.h>
+#include "debug.h"
+#include "perf.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+    int fds[PERF_EVENT_COUNT];
+    // position of each event in a group read, -1 if the event is missing
+    int slots[PERF_EVENT_COUNT];
+    int opened;
+    // cost of the sampling itself, subtracted from every interval
+    uint64_t overhead[PERF_EVENT_COUNT];
+    uint64_t last[PERF_EVENT_COUNT];
+    int current;
+    OpcodeCounters opcodes[UINT8_MAX + 1];
+} PerfCounters;
+
+static PerfCounters perf = {.opened = 0, .current = -1};
+
+#ifdef __linux__
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} event_configs[PERF_EVENT_COUNT] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_L1D_MISSES] = {
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    }
+};
+
+static int open_event(PerfEvent event, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event_configs[event].type;
+    attr.config = event_configs[event].config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static bool read_counters(uint64_t *values) {
+    // layout of a PERF_FORMAT_GROUP read: nr, then one value per event
+    uint64_t buffer[1 + PERF_EVENT_COUNT];
+    ssize_t size = sizeof(uint64_t) * (1 + perf.opened);
+    if (read(perf.fds[0], buffer, size) != size) {
+        return false;
+    }
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        values[i] = perf.slots[i] == -1 ? 0 : buffer[1 + perf.slots[i]];
+    }
+    return true;
+}
+
+static void calibrate() {
+    uint64_t before[PERF_EVENT_COUNT], after[PERF_EVENT_COUNT];
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        perf.overhead[i] = UINT64_MAX;
+    }
+    for (int round = 0; round < 64; round++) {
+        read_counters(before);
+        read_counters(after);
+        for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+            uint64_t delta = after[i] - before[i];
+            if (delta < perf.overhead[i]) perf.overhead[i] = delta;
+        }
+    }
+}
+
+bool init_perf_counters() {
+    memset(perf.opcodes, 0, sizeof(perf.opcodes));
+    perf.current = -1;
+    perf.opened = 0;
+    int leader = -1;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        perf.slots[i] = -1;
+        int fd = open_event(i, leader);
+        if (fd == -1) {
+            // the leader carries the group, without it nothing is counted
+            if (i == PERF_CYCLES) break;
+            continue;
+        }
+        if (leader == -1) leader = fd;
+        perf.fds[perf.opened] = fd;
+        perf.slots[i] = perf.opened++;
+    }
+
+    if (perf.opened == 0) {
+        fprintf(stderr, "perf_event_open unavailable, "
+            "falling back to opcode counts.\n");
+        return false;
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    calibrate();
+    return true;
+}
+
+void free_perf_counters() {
+    for (int i = 0; i < perf.opened; i++) {
+        close(perf.fds[i]);
+    }
+    perf.opened = 0;
+}
+#else
+bool init_perf_counters() {
+    memset(perf.opcodes, 0, sizeof(perf.opcodes));
+    perf.current = -1;
+    return false;
+}
+
+void free_perf_counters() {}
+
+static bool read_counters(UNUSED uint64_t *values) {
+    return false;
+}
+#endif
+
+static void close_interval() {
+    uint64_t now[PERF_EVENT_COUNT];
+    if (perf.current == -1 || perf.opened == 0 || !read_counters(now)) {
+        return;
+    }
+    OpcodeCounters *counters = &perf.opcodes[perf.current];
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        uint64_t delta = now[i] - perf.last[i];
+        delta = delta > perf.overhead[i] ? delta - perf.overhead[i] : 0;
+        counters->events[i] += delta;
+    }
+}
+
+void perf_sample(uint8_t opcode) {
+    close_interval();
+    perf.current = opcode;
+    perf.opcodes[opcode].count++;
+    // read last so the bookkeeping above is not charged to the handler
+    if (perf.opened > 0) read_counters(perf.last);
+}
+
+void perf_sample_end() {
+    close_interval();
+    perf.current = -1;
+}
+
+static double ratio(uint64_t numerator, uint64_t denominator) {
+    return denominator == 0 ? 0.0 : (double)numerator / (double)denominator;
+}
+
+void print_perf_counters(FILE *file) {
+    bool has[PERF_EVENT_COUNT];
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        has[i] = perf.opened > 0 && perf.slots[i] != -1;
+    }
+
+    fprintf(file, "%-24s %12s %10s %8s %10s %11s\n",
+        "opcode", "count", "cycles/op", "IPC", "mispred/op", "L1D-miss/op");
+    for (int opcode = 0; opcode <= UINT8_MAX; opcode++) {
+        OpcodeCounters *counters = &perf.opcodes[opcode];
+        if (counters->count == 0) continue;
+        uint64_t *events = counters->events;
+        fprintf(file, "%-24s %12llu", opcode_name(opcode),
+            (unsigned long long)counters->count);
+        if (has[PERF_CYCLES]) {
+            fprintf(file, " %10.2f",
+                ratio(events[PERF_CYCLES], counters->count));
+        } else {
+            fprintf(file, " %10s", "-");
+        }
+        if (has[PERF_CYCLES] && has[PERF_INSTRUCTIONS]) {
+            fprintf(file, " %8.2f",
+                ratio(events[PERF_INSTRUCTIONS], events[PERF_CYCLES]));
+        } else {
+            fprintf(file, " %8s", "-");
+        }
+        if (has[PERF_BRANCH_MISSES]) {
+            fprintf(file, " %10.3f",
+                ratio(events[PERF_BRANCH_MISSES], counters->count));
+        } else {
+            fprintf(file, " %10s", "-");
+        }
+        if (has[PERF_L1D_MISSES]) {
+            fprintf(file, " %11.3f",
+                ratio(events[PERF_L1D_MISSES], counters->count));
+        } else {
+            fprintf(file, " %11s", "-");
+        }
+        fprintf(file, "\n");
+    }
+}
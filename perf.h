@@ -0,0 +1,36 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+#include "common.h"
+
+// Hardware events sampled around every opcode handler in --perf-counters
+// mode. Any of them may be missing on a given machine or kernel.
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_EVENT_COUNT
+} PerfEvent;
+
+typedef struct {
+    uint64_t count;
+    uint64_t events[PERF_EVENT_COUNT];
+} OpcodeCounters;
+
+// Opens the counters. Returns false if none of them are available, in
+// which case sampling degrades to plain per-opcode execution counts.
+bool init_perf_counters();
+void free_perf_counters();
+
+// Closes the interval of the previously sampled opcode and starts a new one
+// for `opcode`. Called by instrument() right before each handler.
+void perf_sample(uint8_t opcode);
+
+// Closes the interval of the last sampled opcode without starting a new one.
+void perf_sample_end();
+
+void print_perf_counters(FILE *file);
+
+#endif
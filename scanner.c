@@ -1,66 +1,129 @@
 #include <stdbool.h>
 #include <string.h>
-#include <ctype.h>
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
 Scanner scanner;
 
+// Tokens are scanned TOKEN_BATCH at a time, a field per array, so the loop
+// in scan_batch() goes from one token to the next without building a
+// Token. next_token() hands them out one by one. The arrays are a ring
+// that keeps the batch before too, so the compiler going back a little
+// (see restore_scanner()) finds the tokens still there. Offsets are into
+// the source; an error token's length picks its message.
+#define TOKEN_BATCH 512
+#define TOKEN_RING (2 * TOKEN_BATCH)
+#define RING_SLOT(token) ((token) & (TOKEN_RING - 1))
+
+typedef enum {
+    ERROR_UNTERMINATED_STRING,
+    ERROR_UNEXPECTED_CHARACTER
+} ScanError;
+
+static const char *const error_messages[] = {
+    [ERROR_UNTERMINATED_STRING] = "Unterminated string",
+    [ERROR_UNEXPECTED_CHARACTER] = "Unexpected character"
+};
+
+// Tokens are numbered from the start of the source. The ring holds those
+// from `first` up to `end`.
+static struct {
+    int first;
+    int end;
+    int next;
+    TokenType types[TOKEN_RING];
+    uint32_t offsets[TOKEN_RING];
+    uint32_t lengths[TOKEN_RING];
+    // where the token ends, as Token.line
+    int lines[TOKEN_RING];
+} tokens;
+
+// the ScanError of the last TOKEN_ERROR
+static ScanError scan_error;
+
 void init_scanner(const char *source) {
+    scanner.source = source;
     scanner.start = source;
     scanner.current = source;
     scanner.line = 1;
+    scanner.token = 0;
+    tokens.first = 0;
+    tokens.end = 0;
+    tokens.next = 0;
 }
 
-static Token make_token(TokenType type) {
-    return (Token){
-        .type = type,
-        .start = scanner.start,
-        .length = (int)(scanner.current - scanner.start),
-        .line = scanner.line
-    };
+// the scanner as it was before the next token handed out
+Scanner save_scanner() {
+    Scanner state = scanner;
+    state.token = tokens.next;
+    if (tokens.next == tokens.end) {
+        return state;
+    }
+    int next = RING_SLOT(tokens.next);
+    state.start = scanner.source + tokens.offsets[next];
+    state.current = state.start;
+    state.line = tokens.lines[next];
+    if (tokens.types[next] == TOKEN_STRING) {
+        // lines counts the ones inside the string too
+        for (uint32_t i = 0; i < tokens.lengths[next]; i++) {
+            if (state.start[i] == '\n') state.line--;
+        }
+    }
+    return state;
 }
 
-static Token error_token(const char *message) {
-    return (Token){
-        .type = TOKEN_ERROR,
-        .start = message,
-        .length = strlen(message),
-        .line = scanner.line
-    };
+void restore_scanner(Scanner state) {
+    if (state.token >= tokens.first && state.token < tokens.end) {
+        tokens.next = state.token;
+        return;
+    }
+    // scanned again from there
+    scanner = state;
+    tokens.first = state.token;
+    tokens.end = state.token;
+    tokens.next = state.token;
+}
+
+static inline TokenType error_token(ScanError error) {
+    scan_error = error;
+    return TOKEN_ERROR;
+}
+
+// ASCII only, as isalpha() and isdigit() are in the C locale, without
+// their table lookup through a call
+static inline bool is_digit(char c) {
+    return (unsigned)(c - '0') < 10;
+}
+
+static inline bool is_alpha(char c) {
+    return (unsigned)((c | 0x20) - 'a') < 26 || c == '_';
 }
 
-static bool match(char expected) {
-    if (*scanner.current == '\0' || *scanner.current != expected) {
+static inline bool match(Scanner *s, char expected) {
+    if (*s->current == '\0' || *s->current != expected) {
         return false;
     }
-    scanner.current++;
+    s->current++;
     return true;
 }
 
-static void skip_whitespace_and_comments() {
+static inline void skip_whitespace_and_comments(Scanner *s) {
     for (;;) {
-        switch (*scanner.current) {
+        switch (*s->current) {
             case ' ':
             case '\r':
             case '\t':
-                scanner.current++;
+                s->current++;
                 break;
             case '\n':
-                scanner.line++;
-                scanner.current++;
+                s->line++;
+                s->current++;
                 break;
             case '/':
-                if (scanner.current[1] == '/') {
-                    scanner.current++;
-                    while ((*scanner.current != '\n') && (*scanner.current != '\0')) {
-                        scanner.current++;
+                if (s->current[1] == '/') {
+                    s->current++;
+                    while ((*s->current != '\n') && (*s->current != '\0')) {
+                        s->current++;
                     }
                 } else {
                     return;
@@ -72,150 +135,210 @@ static void skip_whitespace_and_comments() {
     }
 }
 
-static TokenType check_keyword(
-    int start, int length, const char *rest, TokenType type
+static inline TokenType check_keyword(
+    Scanner *s, int start, int length, const char *rest, TokenType type
 ) {
-    if (scanner.current - scanner.start == start + length) {
-        if (memcmp(scanner.start + start, rest, length) == 0) {
+    if (s->current - s->start == start + length) {
+        if (memcmp(s->start + start, rest, length) == 0) {
             return type;
         }
     }
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifier_type() {
-    switch (scanner.start[0]) {
+static inline TokenType identifier_type(Scanner *s) {
+    switch (s->start[0]) {
         case 'a':
-            return check_keyword(1, 2, "nd", TOKEN_AND);
+            return check_keyword(s, 1, 2, "nd", TOKEN_AND);
         case 'c':
-            return check_keyword(1, 4, "lass", TOKEN_CLASS);
+            return check_keyword(s, 1, 4, "lass", TOKEN_CLASS);
+        case 'd':
+            return check_keyword(s, 1, 5, "elete", TOKEN_DELETE);
         case 'e':
-            return check_keyword(1, 3, "lse", TOKEN_ELSE);
+            return check_keyword(s, 1, 3, "lse", TOKEN_ELSE);
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
+            if (s->current - s->start > 1) {
+                switch (s->start[1]) {
                     case 'a': 
-                        return check_keyword(2, 3, "lse", TOKEN_FALSE);
+                        return check_keyword(s, 2, 3, "lse", TOKEN_FALSE);
                     case 'o': 
-                        return check_keyword(2, 1, "r", TOKEN_FOR);
+                        return check_keyword(s, 2, 1, "r", TOKEN_FOR);
                     case 'u': 
-                        return check_keyword(2, 1, "n", TOKEN_FUN);
+                        return check_keyword(s, 2, 1, "n", TOKEN_FUN);
                 }
             }
             break;
         case 'i':
-            return check_keyword(1, 1, "f", TOKEN_IF);
+            if (s->current - s->start > 1) {
+                switch (s->start[1]) {
+                    case 'f':
+                        return check_keyword(s, 2, 0, "", TOKEN_IF);
+                    case 'n':
+                        return check_keyword(s, 2, 0, "", TOKEN_IN);
+                }
+            }
+            break;
         case 'n':
-            return check_keyword(1, 2, "il", TOKEN_NIL);
+            return check_keyword(s, 1, 2, "il", TOKEN_NIL);
         case 'o':
-            return check_keyword(1, 1, "r", TOKEN_OR);
+            return check_keyword(s, 1, 1, "r", TOKEN_OR);
         case 'p':
-            return check_keyword(1, 4, "rint", TOKEN_PRINT);
+            return check_keyword(s, 1, 4, "rint", TOKEN_PRINT);
         case 'r':
-            return check_keyword(1, 5, "eturn", TOKEN_RETURN);
+            return check_keyword(s, 1, 5, "eturn", TOKEN_RETURN);
         case 's':
-            return check_keyword(1, 4, "uper", TOKEN_SUPER);
+            return check_keyword(s, 1, 4, "uper", TOKEN_SUPER);
         case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
+            if (s->current - s->start > 1) {
+                switch (s->start[1]) {
                     case 'h': 
-                        return check_keyword(2, 2, "is", TOKEN_THIS);
+                        return check_keyword(s, 2, 2, "is", TOKEN_THIS);
                     case 'r': 
-                        return check_keyword(2, 2, "ue", TOKEN_TRUE);
+                        return check_keyword(s, 2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
         case 'v':
-            return check_keyword(1, 2, "ar", TOKEN_VAR);
+            return check_keyword(s, 1, 2, "ar", TOKEN_VAR);
         case 'w':
-            return check_keyword(1, 4, "hile", TOKEN_WHILE);
+            return check_keyword(s, 1, 4, "hile", TOKEN_WHILE);
     }
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-    while (isalnum(*scanner.current) || *scanner.current == '_') {
-        scanner.current++;
+static inline TokenType identifier(Scanner *s) {
+    while (is_alpha(*s->current) || is_digit(*s->current)) {
+        s->current++;
     }
-    return make_token(identifier_type());
+    return identifier_type(s);
 }
 
-static Token number() {
-    while (isdigit(*scanner.current)) scanner.current++;
+static inline TokenType number(Scanner *s) {
+    while (is_digit(*s->current)) s->current++;
 
-    if (*scanner.current == '.' && isdigit(scanner.current[1])) {
-        scanner.current++;
+    if (*s->current == '.' && is_digit(s->current[1])) {
+        s->current++;
     }
 
-    while (isdigit(*scanner.current)) scanner.current++;
-    return make_token(TOKEN_NUMBER);
+    while (is_digit(*s->current)) s->current++;
+    return TOKEN_NUMBER;
 }
 
-static Token string() {
-    while (*scanner.current != '"' && *scanner.current != '\0') {
-        if (*scanner.current == '\n') {
-            scanner.line++;
+static inline TokenType string(Scanner *s) {
+    while (*s->current != '"' && *s->current != '\0') {
+        if (*s->current == '\n') {
+            s->line++;
         }
-        scanner.current++;
+        s->current++;
     }
 
-    if (*scanner.current == '\0') {
-        return error_token("Unterminated string");
+    if (*s->current == '\0') {
+        return error_token(ERROR_UNTERMINATED_STRING);
     }
-    scanner.current++;
-    return make_token(TOKEN_STRING);
+    s->current++;
+    return TOKEN_STRING;
 }
 
-Token scan_token() {
-    skip_whitespace_and_comments();
-    scanner.start = scanner.current;
+// Scans the next token, from s->start to s->current.
+static inline TokenType scan_token(Scanner *s) {
+    skip_whitespace_and_comments(s);
+    s->start = s->current;
 
-    if (*scanner.current == '\0') {
-        return make_token(TOKEN_EOF);
+    if (*s->current == '\0') {
+        return TOKEN_EOF;
     }
 
-    if (*scanner.current == '_' || isalpha(*scanner.current)) {
-        return identifier();
+    if (is_alpha(*s->current)) {
+        return identifier(s);
     }
 
-    if (isdigit(*scanner.current)) {
-       return number();
+    if (is_digit(*s->current)) {
+       return number(s);
     }
 
-    switch (*scanner.current++) {
+    switch (*s->current++) {
         case '(':
-            return make_token(TOKEN_LEFT_PAREN);
+            return TOKEN_LEFT_PAREN;
         case ')':
-            return make_token(TOKEN_RIGHT_PAREN);
+            return TOKEN_RIGHT_PAREN;
         case '{':
-            return make_token(TOKEN_LEFT_BRACE);
+            return TOKEN_LEFT_BRACE;
         case '}':
-            return make_token(TOKEN_RIGHT_BRACE);
+            return TOKEN_RIGHT_BRACE;
+        case '[':
+            return TOKEN_LEFT_BRACKET;
+        case ']':
+            return TOKEN_RIGHT_BRACKET;
         case ';':
-            return make_token(TOKEN_SEMICOLON);
+            return TOKEN_SEMICOLON;
+        case ':':
+            return TOKEN_COLON;
         case ',':
-            return make_token(TOKEN_COMMA);
+            return TOKEN_COMMA;
         case '.':
-            return make_token(TOKEN_DOT);
+            return TOKEN_DOT;
         case '-':
-            return make_token(TOKEN_MINUS);
+            return TOKEN_MINUS;
         case '+':
-            return make_token(TOKEN_PLUS);
+            return TOKEN_PLUS;
         case '/':
-            return make_token(TOKEN_SLASH);
+            return TOKEN_SLASH;
         case '*':
-            return make_token(TOKEN_STAR);
+            return TOKEN_STAR;
         case '!':
-            return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return match(s, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG;
         case '=':
-            return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return match(s, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL;
         case '<':
-            return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return match(s, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS;
         case '>':
-            return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return match(s, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER;
         case '"':
-            return string();
+            return string(s);
     }
 
-    return error_token("Unexpected character");
+    return error_token(ERROR_UNEXPECTED_CHARACTER);
+}
+
+// once per batch, kept out of next_token() so that stays small enough to
+// inline into the parser
+__attribute__((noinline))
+static void scan_batch() {
+    // a copy the compiler can keep in registers
+    Scanner s = scanner;
+    int end = tokens.end;
+    int last = end + TOKEN_BATCH;
+    while (end < last) {
+        TokenType type = scan_token(&s);
+        int slot = RING_SLOT(end++);
+        tokens.types[slot] = type;
+        tokens.offsets[slot] = (uint32_t)(s.start - s.source);
+        tokens.lengths[slot] = type == TOKEN_ERROR
+            ? (uint32_t)scan_error : (uint32_t)(s.current - s.start);
+        tokens.lines[slot] = s.line;
+        if (type == TOKEN_EOF) break;
+    }
+    scanner = s;
+    tokens.end = end;
+    if (end - tokens.first > TOKEN_RING) {
+        tokens.first = end - TOKEN_RING;
+    }
+}
+
+Token next_token() {
+    if (tokens.next == tokens.end) {
+        scan_batch();
+    }
+    int next = RING_SLOT(tokens.next++);
+    Token token = {
+        .type = tokens.types[next],
+        .start = scanner.source + tokens.offsets[next],
+        .length = (int)tokens.lengths[next],
+        .line = tokens.lines[next]
+    };
+    if (token.type == TOKEN_ERROR) {
+        token.start = error_messages[token.length];
+        token.length = (int)strlen(token.start);
+    }
+    return token;
 }
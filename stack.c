@@ -0,0 +1,146 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "memory.h"
+#include "stack.h"
+#include "vm.h"
+
+static size_t page_size;
+static struct sigaction previous_action;
+
+static size_t round_to_page(size_t bytes) {
+    return (bytes + page_size - 1) & ~(page_size - 1);
+}
+
+static size_t slots_in_pages(size_t slots) {
+    return round_to_page(slots * sizeof(Value)) / sizeof(Value);
+}
+
+// Reserves room for `slots` plus the guard page, with the first
+// `committed` slots accessible.
+static Value *map_stack(size_t slots, size_t committed) {
+    size_t bytes = slots * sizeof(Value) + page_size;
+    void *base = mmap(NULL, bytes, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(base, committed * sizeof(Value), PROT_READ | PROT_WRITE)) {
+        munmap(base, bytes);
+        return NULL;
+    }
+    return (Value *)base;
+}
+
+static void unmap_stack(Value *stack, size_t slots) {
+    munmap(stack, slots * sizeof(Value) + page_size);
+}
+
+static bool commit(size_t slots) {
+    size_t old_bytes = vm.stack_committed * sizeof(Value);
+    size_t new_bytes = slots * sizeof(Value);
+    if (mprotect((char *)vm.stack + old_bytes, new_bytes - old_bytes,
+            PROT_READ | PROT_WRITE)) {
+        return false;
+    }
+    track_memory(MEM_STACK, old_bytes, new_bytes);
+    vm.stack_committed = slots;
+    return true;
+}
+
+static void handle_segv(int signal, siginfo_t *info, void *context) {
+    char *address = (char *)info->si_addr;
+    char *base = (char *)vm.stack;
+    char *end = base + vm.stack_reserved * sizeof(Value) + page_size;
+
+    if (address >= base && address < end) {
+        size_t slot = (size_t)(address - base) / sizeof(Value);
+        if (slot < vm.stack_limit) {
+            size_t slots = 2 * vm.stack_committed;
+            if (slots <= slot) slots = slot + 1;
+            if (slots > vm.stack_limit) slots = vm.stack_limit;
+            if (commit(slots_in_pages(slots))) {
+                // returning retries the faulting store
+                return;
+            }
+        }
+        siglongjmp(vm.stack_overflow, 1);
+    }
+
+    // not ours, let the previous handler or the default action deal with it
+    sigaction(SIGSEGV, &previous_action, NULL);
+    if (previous_action.sa_flags & SA_SIGINFO) {
+        previous_action.sa_sigaction(signal, info, context);
+    } else if (previous_action.sa_handler != SIG_DFL
+               && previous_action.sa_handler != SIG_IGN) {
+        previous_action.sa_handler(signal);
+    }
+}
+
+void init_stack(size_t limit) {
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    vm.stack_limit = slots_in_pages(limit);
+    vm.stack_reserved = vm.stack_limit;
+    vm.stack_committed = slots_in_pages(
+        STACK_INITIAL_SLOTS < vm.stack_limit ? STACK_INITIAL_SLOTS : vm.stack_limit
+    );
+    vm.stack = map_stack(vm.stack_reserved, vm.stack_committed);
+    if (vm.stack == NULL) {
+        fprintf(stderr, "Could not map the value stack.\n");
+        exit(1);
+    }
+    track_memory(MEM_STACK, 0, vm.stack_committed * sizeof(Value));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_segv;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_action);
+}
+
+void free_stack() {
+    sigaction(SIGSEGV, &previous_action, NULL);
+    track_memory(MEM_STACK, vm.stack_committed * sizeof(Value), 0);
+    unmap_stack(vm.stack, vm.stack_reserved);
+    vm.stack = NULL;
+}
+
+bool set_stack_limit(size_t limit) {
+    size_t used = (size_t)(vm.top - vm.stack);
+    limit = slots_in_pages(limit);
+    if (limit <= used) {
+        return false;
+    }
+    if (limit <= vm.stack_reserved) {
+        if (vm.stack_committed > limit) {
+            // give back what is above the new limit
+            size_t old_bytes = vm.stack_committed * sizeof(Value);
+            mprotect((char *)vm.stack + limit * sizeof(Value),
+                old_bytes - limit * sizeof(Value), PROT_NONE);
+            track_memory(MEM_STACK, old_bytes, limit * sizeof(Value));
+            vm.stack_committed = limit;
+        }
+        vm.stack_limit = limit;
+        return true;
+    }
+
+    // the reservation is too small: map a bigger one and move over
+    Value *stack = map_stack(limit, vm.stack_committed);
+    if (stack == NULL) {
+        return false;
+    }
+    memcpy(stack, vm.stack, used * sizeof(Value));
+    for (int i = 0; i < vm.frame_count; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    vm.top = stack + used;
+    unmap_stack(vm.stack, vm.stack_reserved);
+    vm.stack = stack;
+    vm.stack_reserved = limit;
+    vm.stack_limit = limit;
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include "common.h"
+
+// The value stack lives in its own mapping. Only the first part is
+// readable and writable, the rest of the reservation and one guard page
+// after it are PROT_NONE. A push into the inaccessible part traps: below
+// the limit the SIGSEGV handler commits more of the reservation and the
+// push is retried, past the limit it long-jumps back into run(), which
+// reports "Stack overflow.". push() itself never checks bounds.
+
+#define STACK_INITIAL_SLOTS 4096
+#define STACK_DEFAULT_LIMIT (1024 * 1024)
+
+void init_stack(size_t limit);
+void free_stack();
+
+// Changes the maximum number of slots. Growing past the reservation maps
+// a larger one and moves the stack, so it must not be called while the
+// VM is running. Returns false if the limit is below the slots in use or
+// the mapping fails.
+bool set_stack_limit(size_t limit);
+
+#endif
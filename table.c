@@ -8,14 +8,16 @@
 
 #define LOAD_FACTOR 0.75
 
+#define KEY(ref) ((String *)OBJECT_PTR(ref))
+
 __attribute__((always_inline))
 inline void init_table(Table *table, bool with_capacity) {
     table->count = 0;
     if (with_capacity) {
         table->capacity = 8;
-        table->keys = ALLOCATE(String *, table->capacity);
-        table->values = ALLOCATE(Value, table->capacity);
-        memset(table->keys, 0, 8 * sizeof(String *));
+        table->keys = ALLOCATE(ObjectRef, table->capacity, MEM_TABLE);
+        table->values = ALLOCATE(Value, table->capacity, MEM_TABLE);
+        memset(table->keys, 0, 8 * sizeof(ObjectRef));
         memset(table->values, 0, 8 * sizeof(Value));
     } else {
         table->capacity = 0;
@@ -25,111 +27,53 @@ inline void init_table(Table *table, bool with_capacity) {
 }
 
 void free_table(Table *table) {
-    FREE_ARRAY(String *, table->keys, table->capacity);
-    FREE_ARRAY(Value, table->values, table->capacity);
+    if (table->keys != NULL) {
+        FREE_ARRAY(ObjectRef, table->keys, table->capacity, MEM_TABLE);
+        FREE_ARRAY(Value, table->values, table->capacity, MEM_TABLE);
+    }
     init_table(table, false);
 }
 
-static void rehash_table(Table *table, int new_capacity) {
-    String **keys = ALLOCATE(String *, new_capacity);
-    Value *values = ALLOCATE(Value, new_capacity);
-    memset(keys, 0, new_capacity * sizeof(String *));
-    memset(values, 0, new_capacity * sizeof(Value));
-
-    String **old_keys = table->keys;
-    Value *old_values = table->values;
+// Table: interned strings, compared by reference
+#define TABLE Table
+#define KEY_TYPE String *
+#define SLOT_TYPE ObjectRef
+#define TO_SLOT(key) OBJECT_REF(key)
+#define EMPTY(slot) ((slot) == NULL_REF)
+#define KEY_HASH(key) ((key)->hash)
+#define SLOT_HASH(slot) (KEY(slot)->hash)
+#define MATCHES(slot, key) ((slot) == OBJECT_REF(key))
+#define NAME(name) string_keys_##name
+#include "table_core.h"
+#undef NAME
+#undef MATCHES
+#undef SLOT_HASH
+#undef KEY_HASH
+#undef EMPTY
+#undef TO_SLOT
+#undef SLOT_TYPE
+#undef KEY_TYPE
+#undef TABLE
 
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        if (old_keys[i] == NULL) {
-            continue;
-        }
-        int index = old_keys[i]->hash & (new_capacity - 1); 
-        table->count++;
-        for (;;) {
-            if (keys[index] == NULL) {
-                keys[index] = old_keys[i];
-                values[index] = old_values[i];
-                break;
-            }
-            index = (index + 1) & (new_capacity - 1);
-        }
-    }
-    FREE_ARRAY(String *, old_keys, table->capacity);
-    FREE_ARRAY(Value, old_values, table->capacity);
-    table->capacity = new_capacity;
-    table->keys = keys;
-    table->values = values;
+bool table_set(Table *table, String *key, Value value) {
+    return string_keys_set(table, key, value);
 }
 
-
-bool table_set(Table *table, String *key, Value value) {
-    if UNLIKELY(table->count + 1 > table->capacity * LOAD_FACTOR) {
-        int capacity = 2 * table->capacity;
-        rehash_table(table, capacity);
-    }
-    int capacity = table->capacity;
-    uint32_t index = key->hash & (capacity - 1);
-    String **keys = table->keys;
-    for (;;) {
-        if (keys[index] == NULL) {
-            // count stays same if it is a tombstone
-            if (IS_NIL(table->values[index])) {
-                table->count++;
-            }
-            keys[index] = key;
-            table->values[index] = value;
-            return true; // new key
-        } else if (keys[index] == key) {
-            table->values[index] = value;
-            return false;
-        }
-        index = (index + 1) & (capacity - 1);
-    }
-    UNREACHABLE();
+int table_index(Table *table, String *key) {
+    return string_keys_index(table, key);
 }
 
 bool table_get(Table *table, String *key, Value *value) {
-    if (table->count == 0) {
+    int index = table_index(table, key);
+    if (index < 0) {
         return false;
     }
-    int capacity = table->capacity;
-    String **keys = table->keys;
-    int index = key->hash & (capacity - 1);
-    for (;;) {
-        if (keys[index] == NULL) {
-            if (IS_NIL(table->values[index])) {
-                return false;
-            } 
-          // found key
-        } else if (keys[index] == key) {
-            *value = table->values[index];
-            return true;
-        }
-        index = (index + 1) & (capacity - 1);
-    }
-    UNREACHABLE();
+    *value = table->values[index];
+    return true;
 }
 
 bool table_delete(Table *table, String *key) {
-    if (table->count == 0) {
-        return false;
-    }
-    int capacity = table->capacity;
-    int index = key->hash & (capacity - 1);
-    String **keys = table->keys;
-    for (;;) {
-        if (keys[index] == key) {
-            // replace with a tombstone
-            keys[index] = NULL;
-            table->values[index] = BOOL_VAL(true);
-            return true;
-        } else if (keys[index] == NULL && IS_NIL(table->values[index])) {
-            return false;
-        }
-        index = (index + 1) & (capacity - 1);
-    }
-    UNREACHABLE();
+    return string_keys_delete(table, key);
 }
 
 String* table_find_string(
@@ -140,19 +84,148 @@ String* table_find_string(
     }
     int capacity = table->capacity;
     uint32_t index = hash & (capacity - 1);
-    String **keys = table->keys;
+    ObjectRef *keys = table->keys;
     for (;;) {
-        if (keys[index] == NULL) {
+        if (keys[index] == NULL_REF) {
             if (IS_NIL(table->values[index])) {
                 return NULL;
             }
-        } else if (keys[index]->hash == hash
-              && keys[index]->length == length
-              && memcmp(keys[index]->data, data, length) == 0
+        } else if (KEY(keys[index])->hash == hash
+              && KEY(keys[index])->length == length
+              && memcmp(string_chars(KEY(keys[index])), data, length) == 0
         ) {
-            return keys[index];
+            return KEY(keys[index]);
         }
         index = (index + 1) & (capacity - 1);
     }
     UNREACHABLE();
 }
+
+void init_value_table(ValueTable *table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->keys = NULL;
+    table->values = NULL;
+}
+
+void free_value_table(ValueTable *table) {
+    if (table->keys != NULL) {
+        FREE_ARRAY(Value, table->keys, table->capacity, MEM_TABLE);
+        FREE_ARRAY(Value, table->values, table->capacity, MEM_TABLE);
+    }
+    init_value_table(table);
+}
+
+// Keys are stored in a normal form in which two keys are equal exactly
+// when their type and payload word are: numbers the way number_value()
+// makes them, with 0 for -0 and one NaN for all of them; nil and bools
+// with the whole word set; heap strings interned. Zero bits are an empty
+// slot, so nil gets a payload of its own.
+#define NIL_KEY ((Value){.type = VAL_NIL, .as = {.integer = 1}})
+
+// false if `key` can not be in any table: a heap string nobody interned
+static inline bool normal_key(Value key, bool insert, Value *normal) {
+    switch (key.type) {
+        case VAL_NIL:
+            *normal = NIL_KEY;
+            return true;
+        case VAL_BOOL:
+            *normal = (Value){
+                .type = VAL_BOOL, .as = {.integer = AS_BOOL(key)}
+            };
+            return true;
+        case VAL_NUMBER: {
+            double number = key.as.number;
+            if (isnan(number)) {
+                *normal = NUMBER_VAL(NAN);
+            } else {
+                *normal = number_value(number == 0 ? 0 : number);
+            }
+            return true;
+        }
+        case VAL_INT:
+        case VAL_SMALL_STRING:
+            *normal = key;
+            return true;
+        case VAL_OBJECT:
+            if (is_objecttype(key, STRING)) {
+                String *string = insert
+                    ? intern_string(AS_STRING(key))
+                    : find_interned(AS_STRING(key));
+                if (string == NULL) {
+                    return false;
+                }
+                *normal = OBJECT_VAL(string);
+                return true;
+            }
+            *normal = key;
+            return true;
+    }
+    UNREACHABLE();
+}
+
+static inline uint32_t hash_key(Value key) {
+    if (is_objecttype(key, STRING)) {
+        // interned, so hashed
+        return AS_STRING(key)->hash;
+    }
+    // the 64-bit finalizer of MurmurHash3, so that ints and the bits of
+    // doubles spread over the low bits
+    uint64_t hash = (uint64_t)key.as.integer ^ ((uint64_t)key.type << 56);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+// ValueTable: normal keys, see above
+#define TABLE ValueTable
+#define KEY_TYPE Value
+#define SLOT_TYPE Value
+#define TO_SLOT(key) (key)
+#define EMPTY(slot) ((slot).type == VAL_NIL && (slot).as.integer == 0)
+#define KEY_HASH(key) hash_key(key)
+#define SLOT_HASH(slot) hash_key(slot)
+#define MATCHES(slot, key) \
+    ((slot).type == (key).type && (slot).as.integer == (key).as.integer)
+#define NAME(name) value_keys_##name
+#include "table_core.h"
+#undef NAME
+#undef MATCHES
+#undef SLOT_HASH
+#undef KEY_HASH
+#undef EMPTY
+#undef TO_SLOT
+#undef SLOT_TYPE
+#undef KEY_TYPE
+#undef TABLE
+
+bool value_table_set(ValueTable *table, Value key, Value value) {
+    Value normal;
+    normal_key(key, true, &normal);
+    return value_keys_set(table, normal, value);
+}
+
+void value_table_rehash(ValueTable *table) {
+    if (table->capacity > 0) {
+        value_keys_rehash(table, table->capacity);
+    }
+}
+
+int value_table_index(ValueTable *table, Value key) {
+    Value normal;
+    if (!normal_key(key, false, &normal)) {
+        return -1;
+    }
+    return value_keys_index(table, normal);
+}
+
+bool value_table_delete(ValueTable *table, Value key) {
+    Value normal;
+    if (!normal_key(key, false, &normal)) {
+        return false;
+    }
+    return value_keys_delete(table, normal);
+}
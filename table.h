@@ -4,10 +4,12 @@
 #include "common.h"
 #include "value.h"
 
+// Keys are interned strings (see intern_string()) and so compare by
+// reference and always carry their hash. An empty slot is NULL_REF.
 typedef struct {
     int count;
     int capacity;
-    String **keys;
+    ObjectRef *keys;
     Value *values;
 } Table;
 
@@ -16,8 +18,37 @@ void free_table(Table *table);
 bool table_set(Table *table, String *key, Value value);
 bool table_delete(Table *table, String *key);
 bool table_get(Table *table, String *key, Value *value);
+// slot of `key` in keys/values, -1 if it is not there; only good until the
+// next table_set() or table_delete()
+int table_index(Table *table, String *key);
 String *table_find_string(
     Table *table, const char *data, int length, uint32_t hash
 );
 
+// Keys are any values, equal the way JavaScript's Map has them: numbers by
+// value with -0 the same as 0 and NaN the same as NaN, strings by content,
+// other objects by reference. Same core as Table, see table_core.h.
+typedef struct {
+    int count;
+    int capacity;
+    Value *keys;
+    Value *values;
+} ValueTable;
+
+void init_value_table(ValueTable *table);
+void free_value_table(ValueTable *table);
+// Returns true for a new key.
+bool value_table_set(ValueTable *table, Value key, Value value);
+// The slot of `key` in keys/values, -1 if there is no entry.
+int value_table_index(ValueTable *table, Value key);
+bool value_table_delete(ValueTable *table, Value key);
+// Places every key again, for when the addresses of object keys changed.
+void value_table_rehash(ValueTable *table);
+
+// whether slot `index` of keys/values holds an entry, for going over them
+static inline bool value_table_has_entry(ValueTable *table, int index) {
+    Value key = table->keys[index];
+    return key.type != VAL_NIL || key.as.integer != 0;
+}
+
 #endif
@@ -0,0 +1,126 @@
+// The open-addressing core of the hash tables in table.c, written once for
+// every key type. This is not a normal header: table.c includes it once per
+// table type, after defining
+//
+//   TABLE                the table struct, with count, capacity, keys, values
+//   KEY_TYPE             the key type, the `keys` array holds them TO_SLOT()
+//   SLOT_TYPE, TO_SLOT(key)
+//   EMPTY(slot)          whether a slot holds no key; new slots are all zero
+//   KEY_HASH(key), SLOT_HASH(slot)
+//   MATCHES(slot, key)
+//   NAME(name)           the name of the function for `name`
+//
+// Linear probing over a power-of-two capacity. Deleting an entry leaves a
+// tombstone, an empty key over a non-nil value, so that probes go past it.
+// `count` includes the tombstones, a rehash drops them.
+
+static void NAME(rehash)(TABLE *table, int new_capacity) {
+    SLOT_TYPE *keys = ALLOCATE(SLOT_TYPE, new_capacity, MEM_TABLE);
+    Value *values = ALLOCATE(Value, new_capacity, MEM_TABLE);
+    memset(keys, 0, new_capacity * sizeof(SLOT_TYPE));
+    memset(values, 0, new_capacity * sizeof(Value));
+
+    SLOT_TYPE *old_keys = table->keys;
+    Value *old_values = table->values;
+
+    table->count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (EMPTY(old_keys[i])) {
+            continue;
+        }
+        int index = SLOT_HASH(old_keys[i]) & (new_capacity - 1);
+        table->count++;
+        for (;;) {
+            if (EMPTY(keys[index])) {
+                keys[index] = old_keys[i];
+                values[index] = old_values[i];
+                break;
+            }
+            index = (index + 1) & (new_capacity - 1);
+        }
+    }
+    if (old_keys != NULL) {
+        FREE_ARRAY(SLOT_TYPE, old_keys, table->capacity, MEM_TABLE);
+        FREE_ARRAY(Value, old_values, table->capacity, MEM_TABLE);
+    }
+    table->capacity = new_capacity;
+    table->keys = keys;
+    table->values = values;
+}
+
+// For a table at its load factor. The capacity is picked for the live
+// entries alone: twice the size if there are no tombstones, but the same or
+// smaller when deletes filled it, so churn does not keep doubling it.
+static void NAME(grow)(TABLE *table) {
+    int live = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (!EMPTY(table->keys[i])) live++;
+    }
+    int capacity = 8;
+    while (live > capacity * LOAD_FACTOR / 2) {
+        capacity *= 2;
+    }
+    NAME(rehash)(table, capacity);
+}
+
+// Returns true for a new key.
+static inline bool NAME(set)(TABLE *table, KEY_TYPE key, Value value) {
+    if UNLIKELY(table->count + 1 > table->capacity * LOAD_FACTOR) {
+        NAME(grow)(table);
+    }
+    int capacity = table->capacity;
+    uint32_t index = KEY_HASH(key) & (capacity - 1);
+    SLOT_TYPE *keys = table->keys;
+    // the first one on the way is reused if the key is not further along
+    int tombstone = -1;
+    for (;;) {
+        if (EMPTY(keys[index])) {
+            if (IS_NIL(table->values[index])) {
+                if (tombstone < 0) {
+                    table->count++;
+                } else {
+                    index = tombstone;
+                }
+                keys[index] = TO_SLOT(key);
+                table->values[index] = value;
+                return true;
+            }
+            if (tombstone < 0) tombstone = index;
+        } else if (MATCHES(keys[index], key)) {
+            table->values[index] = value;
+            return false;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    UNREACHABLE();
+}
+
+static inline int NAME(index)(TABLE *table, KEY_TYPE key) {
+    if (table->count == 0) {
+        return -1;
+    }
+    int capacity = table->capacity;
+    SLOT_TYPE *keys = table->keys;
+    int index = KEY_HASH(key) & (capacity - 1);
+    for (;;) {
+        if (EMPTY(keys[index])) {
+            if (IS_NIL(table->values[index])) {
+                return -1;
+            }
+        } else if (MATCHES(keys[index], key)) {
+            return index;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    UNREACHABLE();
+}
+
+static inline bool NAME(delete)(TABLE *table, KEY_TYPE key) {
+    int index = NAME(index)(table, key);
+    if (index < 0) {
+        return false;
+    }
+    memset(&table->keys[index], 0, sizeof(SLOT_TYPE));
+    table->values[index] = BOOL_VAL(true);
+    return true;
+}
@@ -1,14 +1,17 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "memory.h"
+#include "number.h"
+#include "output.h"
 #include "value.h"
 #include "object.h"
 #include "string.h"
+#include "vm.h"
 
 inline void init_value_array(ValueArray *array, bool with_capacity) {
     array->count = 0;
     array->capacity = with_capacity ? 8 : 0;
-    array->values = with_capacity ? ALLOCATE(Value, 8) : NULL;
+    array->values = with_capacity ? ALLOCATE(Value, 8, MEM_CONSTANTS) : NULL;
 }
 
 void write_value_array(ValueArray *array, Value value) {
@@ -16,7 +19,9 @@ void write_value_array(ValueArray *array, Value value) {
         int old_capacity = array->capacity;
         array->capacity = 2 * old_capacity;
         array->values =
-            GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+            GROW_ARRAY(
+                Value, array->values, old_capacity, array->capacity, MEM_CONSTANTS
+            );
     }
 
     array->values[array->count] = value;
@@ -24,32 +29,83 @@ void write_value_array(ValueArray *array, Value value) {
 }
 
 void free_value_array(ValueArray *array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(Value, array->values, array->capacity, MEM_CONSTANTS);
     init_value_array(array, false);
 }
 
+// For two different heap strings, at least one of them built at runtime.
+static bool strings_equal(String *a, String *b) {
+    if ((a->object.flags & b->object.flags & STRING_INTERNED)
+        || a->length != b->length) {
+        return false;
+    }
+    return intern_string(a) == intern_string(b);
+}
+
 bool is_equal(Value a, Value b) {
-    // SAFETY: This is safe because every Value is constructed via
-    // designated initialization. That guarantees that any fields
-    // not explicitly set — including padding bytes — are zeroed.
-    // Therefore the entire object representation is deterministic,
-    // and `memcmp(&a, &b, sizeof(Value))` is a correct equality check.
-    return memcmp(&a, &b, sizeof(Value)) == 0;
+    // Compared field by field: a Value built in registers and spilled
+    // by the optimizer carries no promise about its padding bytes, and
+    // numbers need IEEE equality (0 == -0, NaN != NaN) anyway.
+    if (IS_INT(a) && IS_INT(b)) {
+        return AS_INT(a) == AS_INT(b);
+    }
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+        case VAL_BOOL:
+            return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL:
+            return true;
+        case VAL_NUMBER:
+        case VAL_INT:
+            UNREACHABLE();
+        case VAL_OBJECT:
+            if (AS_OBJECT(a) == AS_OBJECT(b)) {
+                return true;
+            }
+            return is_objecttype(a, STRING) && is_objecttype(b, STRING)
+                && strings_equal(AS_STRING(a), AS_STRING(b));
+        case VAL_SMALL_STRING:
+            return a.as.integer == b.as.integer;
+    }
+    UNREACHABLE();
 }
 
 void print_value(Value value) {
     switch (value.type) {
         case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            if (AS_BOOL(value)) {
+                write_output(&vm.output, "true", 4);
+            } else {
+                write_output(&vm.output, "false", 5);
+            }
             break;
         case VAL_NIL:
-            printf("nil");
+            write_output(&vm.output, "nil", 3);
             break;
-        case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
+        case VAL_NUMBER: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            int length = format_number(AS_NUMBER(value), buffer);
+            write_output(&vm.output, buffer, length);
+            break;
+        }
+        case VAL_INT: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            int length = format_integer(AS_INT(value), buffer);
+            write_output(&vm.output, buffer, length);
             break;
+        }
         case VAL_OBJECT:
             print_object(value);
             break;
+        case VAL_SMALL_STRING:
+            write_output(
+                &vm.output, SMALL_STRING_DATA(value), SMALL_STRING_LENGTH(value)
+            );
+            break;
     }
 }
@@ -1,45 +1,102 @@
 #ifndef VALUE_H
 #define VALUE_H
 
+#include <math.h>
+#include <string.h>
+#include "cage.h"
 #include "common.h"
 typedef struct Object Object;
 typedef struct String String;
 
+// How objects refer to other objects (and tables to their keys): a
+// 32-bit offset into the heap cage with HEAP_CAGE, a plain pointer
+// otherwise. NULL_REF is no object in both.
+#ifdef HEAP_CAGE
+typedef uint32_t ObjectRef;
+#define OBJECT_REF(object) ((ObjectRef)((char *)(object) - cage_base))
+#define OBJECT_PTR(ref) ((Object *)(cage_base + (ref)))
+#else
+typedef Object *ObjectRef;
+#define OBJECT_REF(object) ((Object *)(object))
+#define OBJECT_PTR(ref) (ref)
+#endif
+#define NULL_REF 0
+
 typedef enum {
     VAL_NIL = 0,
     VAL_BOOL,
     VAL_NUMBER,
-    VAL_OBJECT
+    // a number that is integral, fits in 32 bits and is not -0, see
+    // number_value(); anything that treats it as a double sees no difference.
+    // vm.c relies on VAL_NUMBER & VAL_INT != VAL_INT.
+    VAL_INT,
+    VAL_OBJECT,
+    // a string of up to SMALL_STRING_MAX bytes held in the value itself
+    VAL_SMALL_STRING
 } ValueType;
 
+// Every string value this short is small, so two small strings are equal
+// exactly when their payloads are and never equal to a heap string.
+#define SMALL_STRING_MAX 7
 
 typedef struct {
     ValueType type;
     union {
         bool boolean;
         double number;
+        // an int32_t, widened so that making one writes the whole word
+        int64_t integer;
         Object *object;
     } as;
 } Value;
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_NUMBER(value) \
+    ((value).type == VAL_NUMBER || (value).type == VAL_INT)
+#define IS_INT(value) ((value).type == VAL_INT)
 #define IS_OBJECT(value) ((value).type == VAL_OBJECT)
+#define IS_SMALL_STRING(value) ((value).type == VAL_SMALL_STRING)
 
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_NUMBER(value) \
+    (IS_INT(value) ? (double)(value).as.integer : (value).as.number)
+#define AS_INT(value) ((int32_t)(value).as.integer)
 #define AS_OBJECT(value) ((value).as.object)
+// A small string's bytes are kept in the integer word, zero padded, with
+// the length in the last byte, so comparing two of them is one compare.
+#define SMALL_STRING_DATA(value) ((char *)&(value).as.integer)
+#define SMALL_STRING_LENGTH(value) (SMALL_STRING_DATA(value)[SMALL_STRING_MAX])
 
 #define BOOL_VAL(value) \
     ((Value){.type = VAL_BOOL, .as = {.boolean = value}})
 #define NIL_VAL ((Value){.type = VAL_NIL, .as = {.number = 0}})
 #define NUMBER_VAL(value) \
     ((Value){.type = VAL_NUMBER, .as = {.number = value}})
+#define INT_VAL(value) \
+    ((Value){.type = VAL_INT, .as = {.integer = value}})
 #define OBJECT_VAL(value) \
     ((Value){.type = VAL_OBJECT, .as = {.object = (Object *)value}})
 #define OBJECT_TYPE(value) (AS_OBJECT(value)->type)
 
+// The number as an int when that is exact, as a double otherwise.
+static inline Value number_value(double number) {
+    if (number >= INT32_MIN && number <= INT32_MAX) {
+        int32_t integer = (int32_t)number;
+        if ((double)integer == number && !(integer == 0 && signbit(number))) {
+            return INT_VAL(integer);
+        }
+    }
+    return NUMBER_VAL(number);
+}
+
+static inline Value small_string(const char *data, int length) {
+    Value value = {.type = VAL_SMALL_STRING, .as = {.integer = 0}};
+    memcpy(SMALL_STRING_DATA(value), data, length);
+    SMALL_STRING_LENGTH(value) = (char)length;
+    return value;
+}
+
 typedef struct {
     int capacity;
     int count;
@@ -5,55 +5,125 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "flight.h"
+#include "image.h"
 #include "value.h"
 #include "vm.h"
 #include "object.h"
 #include <string.h>
 #include <time.h>
 #include "memory.h"
+#include "class.h"
+#include "instrument.h"
+#include "list.h"
+#include "map.h"
+#include "perf.h"
+#include "stack.h"
 
 VM vm;
 
-#ifdef DEBUG_TRACE_EXECUTION
-#define INSPECT_STACK()   \
-    do { \
-        printf("          "); \
-        for (Value *slot = vm.stack; slot < vm.top; slot++) { \
-            print_value(*slot); \
-            printf(", "); \
-        } \
-        printf("\n"); \
-        disassemble_instruction(vm.chunk, (int)(vm.ip - vm.chunk->code)); \
-    } while (false)
-#else
-#define INSPECT_STACK()
-#endif
+// frames shown at either end of a stack trace
+#define TRACE_FRAMES 16
 
+static void define_natives();
 
-void init_vm() {
+static void reset_stack() {
     vm.top = vm.stack;
-    vm.objects = NULL;
+    vm.frame_count = 0;
+}
+
+void init_vm() {
+    vm.frames = NULL;
+    vm.frame_capacity = 0;
+    init_stack(STACK_DEFAULT_LIMIT);
+    reset_stack();
+#ifdef HEAP_CAGE
+    init_cage();
+#endif
+    vm.objects = NULL_REF;
+    vm.borrowed_count = 0;
+    vm.next_function_id = 0;
+    vm.functions = NULL;
+#ifdef DEBUG_TRACE_EXECUTION
+    vm.instrumentation = INSTRUMENT_TRACE;
+#else
+    vm.instrumentation = 0;
+#endif
+    vm.instrument_signals = 0;
+    vm.instrument_signals_handled = 0;
+    vm.hot_loops = false;
+    init_output(&vm.output);
     init_table(&vm.strings, true);
     init_table(&vm.globals, true);
+    define_natives();
 }
 
 void free_vm() {
+    flush_output(&vm.output);
     free_table(&vm.strings);
     free_table(&vm.globals);
     free_objects();
+    free_function_table();
+    free_image();
+#ifdef HEAP_CAGE
+    free_cage();
+#endif
+    FREE_ARRAY(CallFrame, vm.frames, vm.frame_capacity, MEM_STACK);
+    free_stack();
+}
+
+// the instruction holding the byte at `index`
+static int instruction_at(Chunk *chunk, size_t index) {
+    int offset = 0;
+    for (;;) {
+        int next = offset + instruction_length(chunk->code[offset]);
+        if ((size_t)next > index) {
+            return offset;
+        }
+        offset = next;
+    }
 }
 
 static void runtime_error(const char *format, ...) {
+    // keep the program output that led here ahead of the message
+    flush_output(&vm.output);
+    if (vm.frame_count > 0) {
+        CallFrame *frame = &vm.frames[vm.frame_count - 1];
+        Chunk *chunk = &frame->function->chunk;
+        size_t index = frame->ip == chunk->code
+            ? 0 : (size_t)(frame->ip - chunk->code - 1);
+        int offset = instruction_at(chunk, index);
+        ValueType type = vm.top > vm.stack ? vm.top[-1].type : VAL_NIL;
+        flight_record(chunk->code + offset, type);
+    }
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    size_t index = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[index];
-    fprintf(stderr, "[line %d] in script\n", line);
-    vm.top = vm.stack;
+    for (int i = vm.frame_count - 1; i >= 0; i--) {
+        if (i == vm.frame_count - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            // deep recursion: keep the innermost and outermost frames
+            fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES - 1;
+        }
+        CallFrame *frame = &vm.frames[i];
+        Function *function = frame->function;
+        // run() only spills ip on calls and errors, a stack overflow can
+        // catch a frame that has not saved it since it was entered
+        size_t index = frame->ip == function->chunk.code
+            ? 0 : (size_t)(frame->ip - function->chunk.code - 1);
+        int line = function->chunk.lines[index];
+        if (function->name == NULL) {
+            fprintf(stderr, "[line %d] in script\n", line);
+        } else {
+            fprintf(stderr, "[line %d] in %s()\n",
+                line, string_cstring(function->name));
+        }
+    }
+    flight_dump(FLIGHT_RUNTIME_ERROR);
+    reset_stack();
 }
 
 void push(Value value) {
@@ -70,184 +140,914 @@ bool is_false(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static bool check_arity(int arity, int arg_count) {
+    if (arg_count != arity) {
+        runtime_error("Expected %d arguments but got %d.", arity, arg_count);
+        return false;
+    }
+    return true;
+}
+
+static bool call(Value callee, int arg_count, int length);
+
+// Calls anything but a Function. A native runs to completion and leaves
+// its result in place of the callee and the arguments. A class puts the
+// new instance in place of the callee and runs its initializer, a bound
+// method its receiver and the method.
+static bool call_object(Value callee, int arg_count, int length) {
+    if (IS_CLASS(callee)) {
+        Class *klass = AS_CLASS(callee);
+        vm.top[-1 - arg_count] = OBJECT_VAL(new_instance(klass));
+        if (klass->initializer != NULL) {
+            return call(OBJECT_VAL(klass->initializer), arg_count, length);
+        }
+        return check_arity(0, arg_count);
+    }
+    if (IS_BOUND_METHOD(callee)) {
+        BoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm.top[-1 - arg_count] = bound->receiver;
+        return call(OBJECT_VAL(bound->method), arg_count, length);
+    }
+    if (!IS_NATIVE(callee)) {
+        runtime_error("Can only call functions and classes.");
+        return false;
+    }
+    Native *native = AS_NATIVE(callee);
+    if (!check_arity(native->arity, arg_count)) {
+        return false;
+    }
+    Value *args = vm.top - arg_count;
+    if (!native->function(args)) {
+        return false;
+    }
+    vm.top = args;
+    return true;
+}
+
+// the call instruction the running frame has just read, `length` bytes
+// long, with the state spilled
+static void record_call(int length) {
+    flight_record(vm.frames[vm.frame_count - 1].ip - length, vm.top[-1].type);
+    if UNLIKELY(flight.sample_period != 0) flight_count_call();
+}
+
+// `length` is that of the calling instruction, for the flight recorder
+static bool call(Value callee, int arg_count, int length) {
+    if UNLIKELY(!IS_FUNCTION(callee)) {
+        return call_object(callee, arg_count, length);
+    }
+    if (!check_arity(AS_FUNCTION(callee)->arity, arg_count)) {
+        return false;
+    }
+    // the script is called from interpret()
+    if (vm.frame_count > 0) record_call(length);
+    if UNLIKELY(vm.frame_count == vm.frame_capacity) {
+        int old_capacity = vm.frame_capacity;
+        vm.frame_capacity = old_capacity < 8 ? 8 : 2 * old_capacity;
+        vm.frames = GROW_ARRAY(
+            CallFrame, vm.frames, old_capacity, vm.frame_capacity, MEM_STACK
+        );
+    }
+    Function *function = AS_FUNCTION(callee);
+    CallFrame *frame = &vm.frames[vm.frame_count++];
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    frame->slots = vm.top - arg_count - 1;
+    return true;
+}
+
+// Replaces the running frame with a call to `callee`: the callee and its
+// arguments slide down over the caller's slots and the frame is reused.
+static bool tail_call(Value callee, int arg_count) {
+    if UNLIKELY(!IS_FUNCTION(callee)) {
+        return call_object(callee, arg_count, 2);
+    }
+    if (!check_arity(AS_FUNCTION(callee)->arity, arg_count)) {
+        return false;
+    }
+    record_call(2);
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    Value *arguments = vm.top - arg_count - 1;
+    memmove(frame->slots, arguments, sizeof(Value) * (arg_count + 1));
+    vm.top = frame->slots + arg_count + 1;
+    frame->function = AS_FUNCTION(callee);
+    frame->ip = frame->function->chunk.code;
+    return true;
+}
+
+// Arithmetic on numbers. Ints stay ints while the result is exact and
+// representable, everything else is done on doubles.
+
+// for two numbers: VAL_INT and VAL_NUMBER only differ in the lowest bit
+#define BOTH_INTS(a, b) (((a).type & (b).type) == VAL_INT)
+
+static inline Value add_numbers(Value a, Value b) {
+    int32_t result;
+    if (LIKELY(BOTH_INTS(a, b))
+        && !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result)) {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtract_numbers(Value a, Value b) {
+    int32_t result;
+    if (LIKELY(BOTH_INTS(a, b))
+        && !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result)) {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiply_numbers(Value a, Value b) {
+    int32_t result;
+    // a zero product with a negative factor is -0, which only a double has
+    if (LIKELY(BOTH_INTS(a, b))
+        && !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result)
+        && (result != 0 || (AS_INT(a) >= 0 && AS_INT(b) >= 0))) {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value divide_numbers(Value a, Value b) {
+    return number_value(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value negate_number(Value a) {
+    // -0 is a double and -INT32_MIN does not fit
+    if (IS_INT(a) && AS_INT(a) != 0 && AS_INT(a) != INT32_MIN) {
+        return INT_VAL(-AS_INT(a));
+    }
+    return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+static inline Value greater_numbers(Value a, Value b) {
+    if LIKELY(BOTH_INTS(a, b)) {
+        return BOOL_VAL(AS_INT(a) > AS_INT(b));
+    }
+    return BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+}
+
+static inline Value less_numbers(Value a, Value b) {
+    if LIKELY(BOTH_INTS(a, b)) {
+        return BOOL_VAL(AS_INT(a) < AS_INT(b));
+    }
+    return BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+}
+
+#undef BOTH_INTS
+
+static Value concatenate(Value a, Value b) {
+    int a_length, b_length;
+    const char *a_data = string_data(&a, &a_length);
+    const char *b_data = string_data(&b, &b_length);
+    int length = a_length + b_length;
+    if (length <= SMALL_STRING_MAX) {
+        char buffer[SMALL_STRING_MAX];
+        memcpy(buffer, a_data, a_length);
+        memcpy(buffer + a_length, b_data, b_length);
+        return small_string(buffer, length);
+    }
+    String *result = make_string(length);
+    memcpy(result->data, a_data, a_length);
+    memcpy(result->data + a_length, b_data, b_length);
+    result->data[length] = '\0';
+    return OBJECT_VAL(result);
+}
+
+// NULL if `index` can index `list`, the error message otherwise
+static const char *check_index(Value list, Value index) {
+    if (!IS_LIST(list)) {
+        return "Only lists and maps can be indexed.";
+    }
+    if (!IS_INT(index)) {
+        return "List index must be an integer.";
+    }
+    if ((uint32_t)AS_INT(index) >= (uint32_t)AS_LIST(list)->count) {
+        return "List index out of range.";
+    }
+    return NULL;
+}
+
+// The slow paths of the property instructions, which run with the state
+// spilled. The instance is in `slot` (the value to store above it for
+// SET_PROPERTY) and gets replaced by the result, as natives do: an out
+// parameter in a local would keep the handlers from tail calling.
+
+// kept out of run(), where inlining it costs the hot handlers registers
+__attribute__((noinline))
+static bool get_property(Value *slot, String *name, PropertyCache *cache) {
+    if (!IS_INSTANCE(*slot)) {
+        runtime_error("Only instances have properties.");
+        return false;
+    }
+    Instance *instance = AS_INSTANCE(*slot);
+    PropertyWay way = lookup_property(cache, instance->shape, name);
+    if (way.slot >= 0) {
+        *slot = instance->fields[way.slot];
+    } else if (way.target != NULL) {
+        *slot = OBJECT_VAL(new_bound_method(*slot, (Function *)way.target));
+    } else {
+        runtime_error("Undefined property '%s'.", string_cstring(name));
+        return false;
+    }
+    return true;
+}
+
+__attribute__((noinline))
+static bool set_property(Value *slot, String *name, PropertyCache *cache) {
+    if (!IS_INSTANCE(slot[-1])) {
+        runtime_error("Only instances have fields.");
+        return false;
+    }
+    Instance *instance = AS_INSTANCE(slot[-1]);
+    PropertyWay way = lookup_store(cache, instance->shape, name);
+    instance_store(instance, (Shape *)way.target, way.slot, slot[0]);
+    return true;
+}
+
+// `receiver.name(arguments)` without making the bound method. A field
+// holding something callable is called in place of the receiver.
+static bool invoke(String *name, PropertyCache *cache, int arg_count) {
+    Value receiver = vm.top[-1 - arg_count];
+    if (!IS_INSTANCE(receiver)) {
+        runtime_error("Only instances have methods.");
+        return false;
+    }
+    Instance *instance = AS_INSTANCE(receiver);
+    PropertyWay *cached = cached_way(cache, instance->shape);
+    PropertyWay way = cached != NULL
+        ? *cached : lookup_property(cache, instance->shape, name);
+    if (way.slot >= 0) {
+        Value callee = instance->fields[way.slot];
+        vm.top[-1 - arg_count] = callee;
+        return call(callee, arg_count, 5);
+    }
+    if (way.target == NULL) {
+        runtime_error("Undefined property '%s'.", string_cstring(name));
+        return false;
+    }
+    return call(OBJECT_VAL(way.target), arg_count, 5);
+}
+
+// The method `super.name` refers to in the running method, whose
+// receiver is `this`. The running method is the same every time a site is
+// reached, so the receiver's shape is enough to cache on.
+static Function *super_method(
+    Value this, String *name, PropertyCache *cache
+) {
+    Instance *instance = AS_INSTANCE(this);
+    PropertyWay *cached = cached_way(cache, instance->shape);
+    if (cached != NULL) {
+        return (Function *)cached->target;
+    }
+    Function *running = vm.frames[vm.frame_count - 1].function;
+    Function *method =
+        find_super_method(instance->shape->klass, running, name);
+    if (method == NULL) {
+        runtime_error(
+            "Undefined superclass method '%s'.", string_cstring(name)
+        );
+        return NULL;
+    }
+    cache_property(cache, (PropertyWay){
+        .shape = instance->shape, .slot = -1, .target = (Object *)method
+    });
+    return method;
+}
+
+__attribute__((noinline))
+static bool get_super(Value *slot, String *name, PropertyCache *cache) {
+    Function *method = super_method(*slot, name, cache);
+    if (method == NULL) {
+        return false;
+    }
+    *slot = OBJECT_VAL(new_bound_method(*slot, method));
+    return true;
+}
+
+static bool super_invoke(String *name, PropertyCache *cache, int arg_count) {
+    Function *method = super_method(vm.top[-1 - arg_count], name, cache);
+    if (method == NULL) {
+        return false;
+    }
+    return call(OBJECT_VAL(method), arg_count, 5);
+}
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic"
 
-static InterpretResult run() {
-    Value *values = vm.chunk->constants.values;
-#define DISPATCH() \
+// The interpreter state lives in locals (or, for the tail-call engine,
+// in arguments) so it can stay in registers: `ip` is the instruction
+// pointer of the running frame and the top of the stack is cached in
+// `tos`. `sp` points at the slot the cached value belongs to, that slot in
+// memory is stale until the state is spilled. The stack is never empty
+// while running, slot 0 holds the script.
+//
+// Each engine below defines how handlers are entered (HANDLER), how the
+// next one is reached (DISPATCH), how operands are read and how `ip` maps
+// back to the frame (SAVE_IP, LOAD_FRAME); the handlers themselves are in
+// handlers.h.
+//
+// Instrumentation (instrument.h) costs nothing while it is off: the
+// engines with a dispatch table keep the plain handlers in `handler_table`
+// and jump through `dispatch_table`, which select_dispatch() fills with
+// either those or a stub that calls instrument() first. The switch engine
+// has no table to swap and checks a flag instead.
+
+// write the cached state back for code that looks at `vm` or the frames
+#define SPILL() \
+    do { \
+        SAVE_IP(); \
+        *sp = tos; \
+        vm.top = sp + 1; \
+    } while (false)
+
+// the old top goes to memory before `value` is evaluated, so reading a
+// local that sits in the top slot sees the right value
+#define PUSH(value) \
     do { \
-        INSPECT_STACK(); \
-        goto *dispatch_table[*vm.ip++]; \
+        *sp++ = tos; \
+        tos = (value); \
     } while (false)
+#define DROP() (tos = *--sp)
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        SPILL(); \
+        runtime_error(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+// Where signals asking for instrumentation get acted on: at calls, returns
+// and loop back-edges, never in the handler itself.
+#define SAFE_POINT() \
+    do { \
+        if UNLIKELY(vm.instrument_signals \
+                    != vm.instrument_signals_handled) { \
+            handle_instrument_signals(); \
+        } \
+    } while (false)
+
+// a flight recorder event for the running instruction, `length` as below
+#define RECORD(length) flight_record(ip - (length), tos.type)
 
-#define BINARY_OP(value_type, op) \
+// Quickening, see chunk.h: `length` is how far ip has moved past the
+// opcode of the running instruction.
+#define SPECIALIZE(length, opcode) \
     do { \
-        INSPECT_STACK(); \
-        Value b = pop(); \
-        Value a = pop(); \
-        if (!IS_NUMBER(b) || !IS_NUMBER(a)) { \
-            runtime_error("Operands must be numbers"); \
-            return INTERPRET_RUNTIME_ERROR; \
+        int offset = CODE_OFFSET() - (length); \
+        if (can_specialize(&frame->function->chunk, offset)) { \
+            REWRITE(offset, opcode); \
         } \
-        push(value_type(AS_NUMBER(a) op AS_NUMBER(b))); \
+    } while (false)
+
+// a guard failed: rewrite back to the generic instruction and run that
+#define DEOPTIMIZE(length, opcode) \
+    do { \
+        int offset = CODE_OFFSET() - (length); \
+        inline_cache(&frame->function->chunk, offset)->deopts++; \
+        REWRITE(offset, opcode); \
+        ip -= (length); \
         DISPATCH(); \
     } while (false)
 
-    static void **dispatch_table[] = {
-       [OP_CONSTANT] = &&CONSTANT,
-       [OP_RETURN] = &&RETURN,
-       [OP_NEGATE] = &&NEGATE,
-       [OP_PRINT] = &&PRINT,
-       [OP_ADD] = &&ADD,
-       [OP_SUBTRACT] = &&SUBTRACT,
-       [OP_MULTIPLY] = &&MULTIPLY,
-       [OP_DIVIDE] = &&DIVIDE,
-       [OP_TRUE] = &&TRUE,
-       [OP_FALSE] = &&FALSE,
-       [OP_NIL] = &&NIL,
-       [OP_NOT] = &&NOT,
-       [OP_POP] = &&POP,
-       [OP_EQUAL] = &&EQUAL,
-       [OP_GREATER] = &&GREATER,
-       [OP_LESS] = &&LESS,
-       [OP_DEFINE_GLOBAL] = &&DEFINE_GLOBAL,
-       [OP_GET_GLOBAL] = &&GET_GLOBAL,
-       [OP_SET_GLOBAL] = &&SET_GLOBAL
-    };
-    DISPATCH();
+// the result replaces the left operand in place
+#define BINARY_OP(operation) \
+    do { \
+        Value a = sp[-1]; \
+        if (!IS_NUMBER(tos) || !IS_NUMBER(a)) { \
+            RUNTIME_ERROR("Operands must be numbers"); \
+        } \
+        sp--; \
+        tos = operation(a, tos); \
+        DISPATCH(); \
+    } while (false)
 
-CONSTANT: {
-    Value constant = values[*vm.ip++];
-    push(constant);
-    DISPATCH();
+// for operands the compiler has proven to be numbers
+#define NUMBER_OP(operation) \
+    do { \
+        Value a = *--sp; \
+        tos = operation(a, tos); \
+        DISPATCH(); \
+    } while (false)
+
+#if defined(DISPATCH_SWITCH) || defined(DISPATCH_GOTO)
+
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        values = frame->function->chunk.constants.values; \
+        loops = frame->function->chunk.loops; \
+    } while (false)
+#define SAVE_IP() (frame->ip = ip)
+#define CODE_OFFSET() ((int)(ip - frame->function->chunk.code))
+#define REWRITE(offset, opcode) \
+    (frame->function->chunk.code[offset] = (opcode))
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (values[READ_BYTE()])
+#define READ_CACHE() \
+    (&frame->function->chunk.properties[READ_SHORT()])
+#define LOOP_SITES() loops
+
+#ifdef DISPATCH_SWITCH
+#define HANDLER(name) case OP_##name:
+#define DISPATCH() goto dispatch
+
+static void select_dispatch(UNUSED bool instrumented) {}
+#else
+#define HANDLER(name) name:
+#define DISPATCH() goto *dispatch_table[READ_BYTE()]
+
+// labels only exist inside run(), which fills these on its first call
+static void *handler_table[OPCODE_COUNT];
+static void *dispatch_table[OPCODE_COUNT];
+static void *instrument_stub;
+
+static void select_dispatch(bool instrumented) {
+    if (instrument_stub == NULL) {
+        return;
+    }
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        dispatch_table[i] = instrumented ? instrument_stub : handler_table[i];
+    }
 }
-    
-PRINT:
-    print_value(pop());
-    printf("\n");
-    DISPATCH();
+#endif
 
-POP:
-    pop();
-    DISPATCH();
+static InterpretResult run() {
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *values;
+    LoopSite *loops;
+    Value *sp = vm.top - 1;
+    Value tos = *sp;
+    LOAD_FRAME();
 
-NEGATE:
-    if (IS_NUMBER(vm.top[-1])) {
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        DISPATCH();
-    } else {
-        runtime_error("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+#ifdef DISPATCH_SWITCH
+dispatch:
+    if UNLIKELY(vm.instrumentation) goto instrument;
+execute:
+    switch (READ_BYTE()) {
+#include "handlers.h"
+        default:
+            UNREACHABLE();
     }
 
-DEFINE_GLOBAL: 
-    String *name = AS_STRING(values[*vm.ip++]);
-    table_set(&vm.globals, name, vm.top[-1]);
-    pop();
+instrument:
+    SPILL();
+    instrument(frame);
+    goto execute;
+#else
+    if UNLIKELY(instrument_stub == NULL) {
+#define LABEL(name, operands) handler_table[OP_##name] = &&name;
+        OPCODES(LABEL)
+#undef LABEL
+        instrument_stub = &&INSTRUMENT;
+        select_dispatch(vm.instrumentation != 0);
+    }
     DISPATCH();
+#include "handlers.h"
 
-GET_GLOBAL: {
-    String *name = AS_STRING(values[*vm.ip++]);
-    Value value;
-    if (!table_get(&vm.globals, name, &value)) {
-        runtime_error("Undefined variable '%s'.", name->data);
-        return INTERPRET_RUNTIME_ERROR;
+INSTRUMENT:
+    ip--;
+    SPILL();
+    instrument(frame);
+    goto *handler_table[READ_BYTE()];
+#endif
+}
+
+#elif defined(DISPATCH_THREADED)
+
+// The threading pass: the opcode becomes its handler's address and the
+// operands are decoded once, into the word after the opcode.
+static int thread_simple(UNUSED Chunk *chunk, int offset) {
+    return offset + 1;
+}
+
+static int thread_constant(Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    chunk->threaded[offset + 1].constant = &chunk->constants.values[constant];
+    return offset + 2;
+}
+
+static int thread_byte(Chunk *chunk, int offset) {
+    chunk->threaded[offset + 1].operand = chunk->code[offset + 1];
+    return offset + 2;
+}
+
+static int thread_jump(Chunk *chunk, int offset) {
+    chunk->threaded[offset + 1].operand =
+        (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return offset + 3;
+}
+
+static int thread_property(Chunk *chunk, int offset) {
+    thread_constant(chunk, offset);
+    int site = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    chunk->threaded[offset + 2].cache = &chunk->properties[site];
+    return offset + 4;
+}
+
+static int thread_invoke(Chunk *chunk, int offset) {
+    thread_property(chunk, offset);
+    chunk->threaded[offset + 4].operand = chunk->code[offset + 4];
+    return offset + 5;
+}
+
+static int thread_loop(Chunk *chunk, int offset) {
+    chunk->threaded[offset + 1].operand =
+        (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    chunk->threaded[offset + 3].operand =
+        (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    return offset + 5;
+}
+
+// Also run again over threaded code to swap in other handlers, which
+// rewrites the operand words with what they already hold.
+static void thread_chunk(Chunk *chunk, void **handlers) {
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t instruction = chunk->code[offset];
+        chunk->threaded[offset].handler = handlers[instruction];
+        switch (instruction) {
+#define THREAD(name, operands) \
+            case OP_##name: \
+                offset = thread_##operands(chunk, offset); \
+                break;
+            OPCODES(THREAD)
+#undef THREAD
+            default:
+                UNREACHABLE();
+        }
     }
-    push(value);
-    DISPATCH();
 }
 
-SET_GLOBAL: {
-    String *name = AS_STRING(values[*vm.ip++]);
-    if (table_set(&vm.globals, name, vm.top[-1])) {
-        table_delete(&vm.globals, name);
-        runtime_error("Undefined variable '%s'.", name->data);
-        return INTERPRET_RUNTIME_ERROR;
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        Chunk *chunk = &frame->function->chunk; \
+        if UNLIKELY(chunk->threaded == NULL) { \
+            chunk->threaded = \
+                ALLOCATE(ThreadedWord, chunk->count, MEM_CODE); \
+            thread_chunk(chunk, dispatch_table); \
+        } \
+        ip = chunk->threaded + (frame->ip - chunk->code); \
+        slots = frame->slots; \
+        loops = chunk->loops; \
+    } while (false)
+#define SAVE_IP() \
+    (frame->ip = frame->function->chunk.code \
+        + (ip - frame->function->chunk.threaded))
+#define CODE_OFFSET() ((int)(ip - frame->function->chunk.threaded))
+#define REWRITE(offset, opcode) \
+    do { \
+        Chunk *chunk = &frame->function->chunk; \
+        chunk->code[offset] = (opcode); \
+        chunk->threaded[offset].handler = dispatch_table[opcode]; \
+    } while (false)
+
+#define READ_BYTE() ((ip++)->operand)
+#define READ_SHORT() (ip += 2, (uint16_t)ip[-2].operand)
+#define READ_CONSTANT() (*(ip++)->constant)
+#define READ_CACHE() (ip += 2, ip[-2].cache)
+#define LOOP_SITES() loops
+
+#define HANDLER(name) name:
+#define DISPATCH() goto *(ip++)->handler
+
+// labels only exist inside run(), which fills these on its first call
+static void *handler_table[OPCODE_COUNT];
+static void *dispatch_table[OPCODE_COUNT];
+static void *instrument_stub;
+
+static void select_dispatch(bool instrumented) {
+    if (instrument_stub == NULL) {
+        return;
+    }
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        dispatch_table[i] = instrumented ? instrument_stub : handler_table[i];
+    }
+    // code threaded so far has the previous handlers baked in
+    for (ObjectRef ref = vm.objects; ref != NULL_REF;
+         ref = OBJECT_PTR(ref)->next) {
+        Object *object = OBJECT_PTR(ref);
+        if (object->type != FUNCTION) continue;
+        Chunk *chunk = &((Function *)object)->chunk;
+        if (chunk->threaded != NULL) {
+            thread_chunk(chunk, dispatch_table);
+        }
     }
-    DISPATCH();
 }
 
-TRUE:
-    push(BOOL_VAL(true));
+static InterpretResult run() {
+    CallFrame *frame;
+    ThreadedWord *ip;
+    Value *slots;
+    LoopSite *loops;
+    Value *sp = vm.top - 1;
+    Value tos = *sp;
+    if UNLIKELY(instrument_stub == NULL) {
+#define LABEL(name, operands) handler_table[OP_##name] = &&name;
+        OPCODES(LABEL)
+#undef LABEL
+        instrument_stub = &&INSTRUMENT;
+        select_dispatch(vm.instrumentation != 0);
+    }
+    LOAD_FRAME();
     DISPATCH();
+#include "handlers.h"
 
-FALSE:
-    push(BOOL_VAL(false));
-    DISPATCH();
+INSTRUMENT:
+    ip--;
+    SPILL();
+    instrument(frame);
+    {
+        Chunk *chunk = &frame->function->chunk;
+        goto *handler_table[chunk->code[ip++ - chunk->threaded]];
+    }
+}
 
-NIL:
-    push(NIL_VAL);
-    DISPATCH();
+#elif defined(DISPATCH_TAILCALL)
 
-NOT:
-    push(BOOL_VAL(is_false(pop())));
-    DISPATCH();
+// Every handler is a function that tail calls the next one. Without
+// musttail this relies on the compiler turning those calls into jumps, see
+// CMakeLists.txt.
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#ifndef MUSTTAIL
+#define MUSTTAIL
+#endif
 
-EQUAL:
-    Value b = pop();
-    Value a = pop();
-    push(BOOL_VAL(is_equal(a, b)));
-    DISPATCH();
+#define HANDLER_PARAMETERS \
+    uint8_t *ip, Value *sp, Value tos, CallFrame *frame, Value *slots
+typedef InterpretResult (*Handler)(HANDLER_PARAMETERS);
 
-GREATER:
-    BINARY_OP(BOOL_VAL, >);
-
-LESS:
-    BINARY_OP(BOOL_VAL, <);
-
-ADD: {
-    Value b = pop();
-    Value a = pop();
-    if (IS_STRING(a) && IS_STRING(b)) {
-        String *s1 = AS_STRING(a);
-        String *s2 = AS_STRING(b);
-        int length = s1->length + s2->length;
-        String *result = make_string(length);
-        memcpy(result->data, s1->data, s1->length);
-        memcpy(result->data + s1->length, s2->data, s2->length);
-        result->data[length] = '\0';
-        push(OBJECT_VAL(result));
-        DISPATCH();
-    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
-        push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
-        DISPATCH();
-    } else {
-        runtime_error("Only strings or numbers are allowed.");
-        return INTERPRET_RUNTIME_ERROR;
+#define DECLARE_HANDLER(name, operands) \
+    static InterpretResult op_##name(HANDLER_PARAMETERS);
+OPCODES(DECLARE_HANDLER)
+#undef DECLARE_HANDLER
+
+#define HANDLER_ENTRY(name, operands) [OP_##name] = op_##name,
+static const Handler handler_table[OPCODE_COUNT] = {
+    OPCODES(HANDLER_ENTRY)
+};
+static Handler dispatch_table[OPCODE_COUNT] = {
+    OPCODES(HANDLER_ENTRY)
+};
+#undef HANDLER_ENTRY
+
+static InterpretResult op_instrument(HANDLER_PARAMETERS);
+
+static void select_dispatch(bool instrumented) {
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        dispatch_table[i] = instrumented ? op_instrument : handler_table[i];
     }
 }
 
-SUBTRACT:
-    BINARY_OP(NUMBER_VAL, -);
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+    } while (false)
+#define SAVE_IP() (frame->ip = ip)
+#define CODE_OFFSET() ((int)(ip - frame->function->chunk.code))
+#define REWRITE(offset, opcode) \
+    (frame->function->chunk.code[offset] = (opcode))
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+// not enough argument registers for the constants and loop sites, they
+// are reloaded through the frame
+#define READ_CONSTANT() \
+    (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_CACHE() \
+    (&frame->function->chunk.properties[READ_SHORT()])
+#define LOOP_SITES() (frame->function->chunk.loops)
 
-MULTIPLY:
-    BINARY_OP(NUMBER_VAL, *);
+#define HANDLER(name) static InterpretResult op_##name(HANDLER_PARAMETERS)
+#define DISPATCH() \
+    MUSTTAIL return dispatch_table[*ip](ip + 1, sp, tos, frame, slots)
 
-DIVIDE:
-    BINARY_OP(NUMBER_VAL, /);
+#include "handlers.h"
 
-RETURN:
-    return INTERPRET_OK;
+static InterpretResult op_instrument(HANDLER_PARAMETERS) {
+    ip--;
+    SPILL();
+    instrument(frame);
+    MUSTTAIL return handler_table[*ip](ip + 1, sp, tos, frame, slots);
 }
-#undef BINARY_OP
+
+static InterpretResult run() {
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    uint8_t *ip = frame->ip;
+    Value *slots = frame->slots;
+    Value *sp = vm.top - 1;
+    Value tos = *sp;
+    DISPATCH();
+}
+
+#undef MUSTTAIL
+
+#endif
+
 #undef DISPATCH
+#undef HANDLER
+#undef LOOP_SITES
+#undef READ_CACHE
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+#undef REWRITE
+#undef CODE_OFFSET
+#undef SAVE_IP
+#undef LOAD_FRAME
+#undef NUMBER_OP
+#undef BINARY_OP
+#undef DEOPTIMIZE
+#undef SPECIALIZE
+#undef RECORD
+#undef SAFE_POINT
+#undef RUNTIME_ERROR
+#undef DROP
+#undef PUSH
+#undef SPILL
 #pragma GCC diagnostic pop
 
+// Natives, see NativeFunction. Errors name the native they come from.
+
+static List *list_argument(Value value, const char *native) {
+    if (!IS_LIST(value)) {
+        runtime_error("%s() takes a list.", native);
+        return NULL;
+    }
+    return AS_LIST(value);
+}
+
+static bool native_len(Value *args) {
+    if (IS_LIST(args[0])) {
+        args[-1] = INT_VAL(AS_LIST(args[0])->count);
+        return true;
+    }
+    if (IS_MAP(args[0])) {
+        args[-1] = INT_VAL(AS_MAP(args[0])->count);
+        return true;
+    }
+    if (IS_STRING(args[0])) {
+        int length;
+        string_data(&args[0], &length);
+        args[-1] = INT_VAL(length);
+        return true;
+    }
+    runtime_error("len() takes a list, a map or a string.");
+    return false;
+}
+
+static bool native_append(Value *args) {
+    List *list = list_argument(args[0], "append");
+    if (list == NULL) return false;
+    list_append(list, args[1]);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool native_fill(Value *args) {
+    List *list = list_argument(args[0], "fill");
+    if (list == NULL) return false;
+    list_fill(list, args[1]);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// sum(), min() and max()
+static bool reduce(
+    Value *args, const char *native, bool (*reduction)(List *, Value *)
+) {
+    List *list = list_argument(args[0], native);
+    if (list == NULL) return false;
+    if (!reduction(list, &args[-1])) {
+        runtime_error("%s() takes a list of numbers.", native);
+        return false;
+    }
+    return true;
+}
+
+static bool native_sum(Value *args) {
+    return reduce(args, "sum", list_sum);
+}
+
+static bool native_min(Value *args) {
+    return reduce(args, "min", list_min);
+}
+
+static bool native_max(Value *args) {
+    return reduce(args, "max", list_max);
+}
+
+static bool native_scale(Value *args) {
+    List *list = list_argument(args[0], "scale");
+    if (list == NULL) return false;
+    List *scaled = list_scale(list, args[1]);
+    if (scaled == NULL) {
+        runtime_error("scale() takes a list of numbers and a number.");
+        return false;
+    }
+    args[-1] = OBJECT_VAL(scaled);
+    return true;
+}
+
+static void define_native(
+    const char *name, int arity, NativeFunction function
+) {
+    String *string = copy_string(name, (int)strlen(name));
+    table_set(&vm.globals, string,
+        OBJECT_VAL(new_native(string, arity, function)));
+}
+
+static const struct {
+    const char *name;
+    int arity;
+    NativeFunction function;
+} natives[] = {
+    {"len", 1, native_len},
+    {"append", 2, native_append},
+    {"fill", 2, native_fill},
+    {"sum", 1, native_sum},
+    {"min", 1, native_min},
+    {"max", 1, native_max},
+    {"scale", 2, native_scale}
+};
+
+#define NATIVE_COUNT ((int)(sizeof(natives) / sizeof(natives[0])))
+
+static void define_natives() {
+    for (int i = 0; i < NATIVE_COUNT; i++) {
+        define_native(natives[i].name, natives[i].arity, natives[i].function);
+    }
+}
+
+NativeFunction find_native(const char *name) {
+    for (int i = 0; i < NATIVE_COUNT; i++) {
+        if (strcmp(natives[i].name, name) == 0) {
+            return natives[i].function;
+        }
+    }
+    return NULL;
+}
+
+#undef NATIVE_COUNT
+
+void set_instrumentation(int flags) {
+    vm.instrumentation = flags;
+    select_dispatch(flags != 0);
+}
+
+// The landing pad for stack overflows lives outside run(), so none of its
+// locals have to survive the long jump.
+static InterpretResult run_guarded() {
+    if (sigsetjmp(vm.stack_overflow, 0)) {
+        // a push ran into the guard page, see stack.h
+        runtime_error("Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return run();
+}
+
+static void report_hot_loops() {
+    for (ObjectRef ref = vm.objects; ref != NULL_REF;
+         ref = OBJECT_PTR(ref)->next) {
+        Object *object = OBJECT_PTR(ref);
+        if (object->type != FUNCTION) continue;
+        Function *function = (Function *)object;
+        const char *name = function->name == NULL
+            ? "script" : string_cstring(function->name);
+        print_hot_loops(stderr, &function->chunk, name);
+    }
+}
+
 InterpretResult interpret(const char *source) {
-    Chunk chunk;
-    init_chunk(&chunk, true);
     // try to compile the source
-    if (!compile(source, &chunk)) {
-        free_chunk(&chunk);
+    Function *function = compile(source);
+    if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    push(OBJECT_VAL(function));
+    call(OBJECT_VAL(function), 0, 0);
 
-    InterpretResult result = run();
-    free_chunk(&chunk);
+    InterpretResult result = run_guarded();
+    // an interval left open by INSTRUMENT_PERF
+    perf_sample_end();
+    if (vm.hot_loops) report_hot_loops();
     return result;
 }
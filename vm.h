@@ -1,19 +1,51 @@
 #ifndef VM_H
 #define VM_H
 
+#include <setjmp.h>
+#include <signal.h>
 #include "table.h"
 #include "chunk.h"
+#include "object.h"
+#include "output.h"
 #include "value.h"
-#define STACK_MAX 256
 
+// The callee and its arguments are left where the caller pushed them,
+// `slots` points at the callee so parameters are locals 1..arity.
 typedef struct {
-    Chunk *chunk;
+    Function *function;
     uint8_t *ip;
-    Value stack[STACK_MAX];
+    Value *slots;
+} CallFrame;
+
+typedef struct {
+    CallFrame *frames;
+    int frame_count;
+    int frame_capacity;
+    // see stack.h, sizes are in slots
+    Value *stack;
+    size_t stack_committed;
+    size_t stack_limit;
+    size_t stack_reserved;
+    sigjmp_buf stack_overflow;
     Value *top;
     Table strings;
     Table globals;
-    Object *objects;
+    ObjectRef objects;
+    // strings pointing into a source, see borrow_string()
+    int borrowed_count;
+    uint32_t next_function_id;
+    // see FunctionTable
+    FunctionTable *functions;
+    OutputBuffer output;
+    // Instrumentation flags (instrument.h), only change them through
+    // set_instrumentation()
+    int instrumentation;
+    // Signals counted by the handler instrument_on_signal() installs, and
+    // how many of them run() has acted on so far
+    volatile sig_atomic_t instrument_signals;
+    sig_atomic_t instrument_signals_handled;
+    // report loop back-edge counts after each run
+    bool hot_loops;
 } VM;
 
 typedef enum {
@@ -27,7 +59,15 @@ extern VM vm;
 
 void init_vm();
 void free_vm();
+// Names and literals of `source` are borrowed: it has to outlive the VM or
+// be given up with release_sources() first.
 InterpretResult interpret(const char *source);
+// Switches run() to the instrumented dispatch table for `flags`, a set of
+// Instrumentation bits, or back to the plain one for 0. Takes effect from
+// the next instruction. Not for signal handlers: it rewrites threaded code.
+void set_instrumentation(int flags);
+// the native function called `name`, NULL if there is none
+NativeFunction find_native(const char *name);
 
 void push(Value value);
 Value pop();